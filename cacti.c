@@ -1,10 +1,49 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
+#include <ucontext.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "cacti.h"
 
+#ifdef CACTI_PROFILE
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* With single worker, pool state is touched only by that worker, so it
+ * runs without pool mutex; other threads hand messages over through
+ * lock-free stack drained by worker. */
+#if POOL_SIZE == 1
+#define SINGLE_WORKER
+#endif
+
+/* With more workers, messages sent by handlers are delivered in batches */
+#if !defined(SINGLE_WORKER) && OUTBOX_LIMIT > 0
+#define USE_OUTBOX
+#endif
+
+/* On x86-64 handlers with stacks are switched by hand, elsewhere through
+ * ucontext */
+#if defined(__x86_64__) && !defined(CACTI_UCONTEXT)
+#define FAST_SWITCH
+#endif
+
+#if BATCH_LIMIT < 1
+#error "BATCH_LIMIT has to be positive"
+#endif
+
 /************************************************************************************/
 /*																					*/
 /*									UTILITY FUNCTIONS 								*/
@@ -35,6 +74,20 @@ static void cond_wait(pthread_cond_t *condition, pthread_mutex_t *mutex) {
 	}
 }
 
+/* Waits at most until deadline, CLOCK_MONOTONIC time in nanoseconds;
+ * condition has to use that clock */
+static void cond_timedwait(pthread_cond_t *condition, pthread_mutex_t *mutex,
+						   unsigned long long deadline) {
+	int err;
+	struct timespec time = { .tv_sec = (time_t) (deadline / 1000000000ull),
+							 .tv_nsec = (long) (deadline % 1000000000ull) };
+
+	if((err = pthread_cond_timedwait(condition, mutex, &time)) != 0 && err != ETIMEDOUT) {
+		perror("Error: pthread_cond_timedwait");
+		exit(1);
+	}
+}
+
 static void cond_signal(pthread_cond_t *condition) {
 	int err;
 	if((err = pthread_cond_signal(condition)) != 0) {
@@ -43,6 +96,14 @@ static void cond_signal(pthread_cond_t *condition) {
 	}
 }
 
+static void cond_broadcast(pthread_cond_t *condition) {
+	int err;
+	if((err = pthread_cond_broadcast(condition)) != 0) {
+		perror("Error: pthread_cond_broadcast");
+		exit(1);
+	}
+}
+
 /************************************************************************************/
 /*																					*/
 /*																					*/
@@ -70,14 +131,109 @@ typedef enum {
 
 typedef enum {
 	waiting 				= 0,
-	working 				= 1
+	working 				= 1,
+	suspended				= 2
 } work_state_t;
 
+/* Actor table capacity when expected number of actors is not given */
+#define DEFAULT_SIZE 512
+
+/* Table arrays are reserved for CAST_LIMIT actors at once and never move,
+ * each starting at HUGE_PAGE_SIZE boundary of the reservation; mailboxes
+ * live in separate regions, one mapped per growth of the table.
+ */
+#define TABLE_ARRAYS 9
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+#define MAILBOX_REGIONS 64
+
+#define SLAB_CLASSES 9
+#define SLAB_MIN_SIZE ((size_t) 16)
+#define SLAB_CHUNK_OBJECTS 64
+
+/* Size-class allocator for runtime-managed actor states. Each class hands
+ * out objects of SLAB_MIN_SIZE << class bytes carved from chunks of
+ * SLAB_CHUNK_OBJECTS objects, freed objects are kept on per-class list.
+ * Larger states bypass slabs. Guarded by pool mutex.
+ */
+typedef struct slab_chunk {
+	struct slab_chunk *next;
+} slab_chunk_t;
+
+typedef struct slab_object {
+	struct slab_object *next;
+} slab_object_t;
+
+typedef struct slab_class {
+	slab_chunk_t *chunks;
+	slab_object_t *free_list;
+} slab_class_t;
+
+/* Handler running on its own stack. Handler sees copy of actor state
+ * pointer, synchronised with pool arrays whenever it gives control back.
+ */
+typedef struct coroutine {
+#ifdef FAST_SWITCH
+	void *context;
+	void **caller;
+#else
+	ucontext_t context;
+	ucontext_t *caller;
+#endif
+	char *stack;
+	size_t stack_size;
+	struct coroutine *next;
+
+	/* Local id of actor whose handler runs */
+	size_t actor;
+
+	void (*fun)(void **stateptr, size_t nbytes, void *data);
+	void *state;
+	size_t nbytes;
+	void *data;
+
+	bool finished;
+	bool cancelled;
+	message_type_t awaited;
+	message_t received;
+	message_t *resume;
+} coroutine_t;
+
+/* Router state; targets are local actor ids */
+typedef struct router {
+	router_policy_t policy;
+	size_t next;
+	unsigned long long seed;
+	size_t ntargets;
+	actor_id_t targets[];
+} router_t;
+
+/* Message sent from outside of worker in single worker mode; message
+ * is first member, so node is released by freeing the message. */
+typedef struct handoff {
+	message_t message;
+	actor_id_t actor;
+	struct handoff *next;
+} handoff_t;
+
+typedef struct region {
+	void *memory;
+	size_t size;
+} region_t;
+
+/* Ring buffer of actors waiting to be served, growing on demand */
+typedef struct run_queue {
+	size_t *items;
+	size_t size;
+	size_t iter;
+	size_t count;
+} run_queue_t;
+
 typedef struct thread_pool {
 	pthread_t *threads;
 	pthread_attr_t attr;
 	pthread_cond_t await_cond;
 	pthread_cond_t finish_cond;
+	pthread_cond_t quiesce_cond;
 	pthread_mutex_t mutex;
 
 	bool shutdown;
@@ -86,38 +242,211 @@ typedef struct thread_pool {
 	size_t waiting_threads;
 	size_t waiting_messages;
 	size_t arrays_size;
+	size_t mailbox_size;
 	size_t pool_size;
 	size_t working_count;
 	size_t actors_count;
 	size_t alive_actors;
 	size_t actors_to_serve;
-	size_t work_queue_iter;
-	size_t work_queue_size;
-	size_t work_queue_count;
+	size_t active_handlers;
+	size_t quiesce_waiters;
+
+	pthread_t watcher;
+	int shutdown_pipe[2];
+	unsigned long long drain_budget;
 
 	size_t *actor_status;
 	size_t *work_state;
 	size_t *queue_iterators;
 	size_t *messages_in_queue;
-	size_t *work_queue;
+	run_queue_t work_queue;
+	run_queue_t *group_queues;
 
 	message_t ***message_queues;
 	role_t **actor_roles;
 	void **actor_state_ptr;
+	router_t **routers;
+	coroutine_t **coroutines;
 	actor_id_t *served_actor;
+
+	bool drop_oldest;
+	drop_hook_t drop_hook;
+
+	huge_pages_t huge_pages;
+	region_t table;
+	region_t mailboxes[MAILBOX_REGIONS];
+	size_t mailbox_regions;
+
+	slab_class_t slabs[SLAB_CLASSES];
+
+	handoff_t *handoff_head;
+	bool worker_sleeping;
+
+	bool defer_wakeups;
+	size_t deferred_wakeups;
+
+	scheduler_policy_t scheduler;
+	size_t pops;
+	size_t ngroups;
+	size_t *group_weights;
+	size_t current_group;
+	size_t group_credit;
 } thread_pool_t;
 
 static thread_pool_t *pool = NULL;
 
+#ifdef USE_OUTBOX
+typedef struct outbox_entry {
+	actor_id_t actor;
+	message_t **mailbox;
+	message_t *message;
+} outbox_entry_t;
+
+/* Messages sent by handlers of this worker thread, not yet delivered */
+typedef struct outbox {
+	bool active;
+	size_t count;
+	outbox_entry_t entries[OUTBOX_LIMIT];
+} outbox_t;
+
+static __thread outbox_t outbox = { .active = false, .count = 0 };
+#endif
+
+static void flush_outbox();
+
+/* Node of this process, 0 unless attached to shared memory segment */
+static size_t local_node = 0;
+
+/* Bumped whenever actor table is created, so that references resolved in
+ * previous actor system are refused */
+static unsigned long system_generation = 0;
+
+/* Write end of pipe watched by shutdown thread, -1 without actor system */
+static volatile sig_atomic_t shutdown_fd = -1;
+
+#define SHUTDOWN_REQUEST 's'
+#define SHUTDOWN_QUIT 'q'
+
+/* Messages dropped by current actor system, kept after it is joined */
+static size_t expired_messages = 0;
+static size_t evicted_messages = 0;
+static size_t undelivered_messages = 0;
+
+static int transport_start();
+static void transport_stop();
+
+/* Signals sleeping worker about newly scheduled actor; while outbox is
+ * flushed signals are counted and sent at once. */
+static void wake_worker() {
+	if(pool->defer_wakeups) {
+		pool->deferred_wakeups++;
+	}
+	else if(pool->waiting_threads > 0) {
+		cond_signal(&pool->await_cond);
+	}
+}
+
+/* Locking of pool state by worker, no-op in single worker mode */
+static void worker_lock() {
+#ifndef SINGLE_WORKER
+	mutex_lock(&pool->mutex);
+#endif
+}
+
+static void worker_unlock() {
+#ifndef SINGLE_WORKER
+	mutex_unlock(&pool->mutex);
+#endif
+}
+
+/* Closes ends of shutdown pipe that are open */
+static void close_shutdown_pipe() {
+	for(size_t i = 0; i < 2; ++i) {
+		if(pool->shutdown_pipe[i] >= 0) {
+			close(pool->shutdown_pipe[i]);
+			pool->shutdown_pipe[i] = -1;
+		}
+	}
+}
+
+static void stop_watcher() {
+	char request = SHUTDOWN_QUIT;
+
+	shutdown_fd = -1;
+
+	/* Watcher is started only once pipe is set up */
+	if(pool->shutdown_pipe[1] < 0) {
+		close_shutdown_pipe();
+		return;
+	}
+
+	if(pthread_equal(pthread_self(), pool->watcher)) {
+		pthread_detach(pool->watcher);
+	}
+	else {
+		if(write(pool->shutdown_pipe[1], &request, 1) != 1) {
+			perror("Critical: write");
+			exit(1);
+		}
+
+		pthread_join(pool->watcher, NULL);
+	}
+
+	close_shutdown_pipe();
+}
+
+static void drop_message(size_t actor_id, message_t *message, size_t *counter);
+static void reclaim_state(size_t actor_id);
+
+/* Frees messages left in mailboxes and handed over to single worker,
+ * passing them to drop hook first, and states of actors that are still
+ * alive. Called once workers are joined.
+ */
+static void discard_messages() {
+	for(size_t i = 0; i < pool->actors_count; ++i) {
+		for(size_t j = 0; j < pool->messages_in_queue[i]; ++j) {
+			message_t *message = pool->message_queues[i][(pool->queue_iterators[i] + j) % pool->mailbox_size];
+
+			drop_message(i, message, NULL);
+			free(message);
+		}
+
+		/* Awaited message already taken for suspended handler */
+		if(pool->coroutines[i] != NULL && pool->coroutines[i]->resume != NULL) {
+			drop_message(i, pool->coroutines[i]->resume, NULL);
+			free(pool->coroutines[i]->resume);
+			pool->coroutines[i]->resume = NULL;
+		}
+
+		if(pool->actor_roles[i] != NULL) {
+			reclaim_state(i);
+		}
+	}
+
+	while(pool->handoff_head != NULL) {
+		handoff_t *next = pool->handoff_head->next;
+
+		drop_message(pool->handoff_head->actor, &pool->handoff_head->message, NULL);
+		free(pool->handoff_head);
+		pool->handoff_head = next;
+	}
+}
+
 static void thread_pool_destroy() {
 	if(pool == NULL) {
 		return;
 	}
 
+	stop_watcher();
+
 	for(size_t i = 0; i < POOL_SIZE; ++i) {
 		pthread_join(pool->threads[i], NULL);
 	}
 
+	discard_messages();
+
+	transport_stop();
+
 	if(pthread_attr_destroy(&pool->attr)) {
 		perror("Error in attr_destroy");
 		exit(1);
@@ -130,17 +459,42 @@ static void thread_pool_destroy() {
 
 
 	for(size_t i = 0; i < pool->arrays_size; ++i) {
-		free(pool->message_queues[i]);
+		free(pool->routers[i]);
+	}
+
+	for(size_t i = 0; i < pool->arrays_size; ++i) {
+		if(pool->coroutines[i] != NULL) {
+			free(pool->coroutines[i]->stack);
+			free(pool->coroutines[i]);
+		}
 	}
 
-	free(pool->work_state);
-	free(pool->actor_roles);
-	free(pool->actor_status);
-	free(pool->actor_state_ptr);
-	free(pool->message_queues);
-	free(pool->messages_in_queue);
-	free(pool->queue_iterators);
-	free(pool->work_queue);
+	for(size_t i = 0; i < pool->mailbox_regions; ++i) {
+		munmap(pool->mailboxes[i].memory, pool->mailboxes[i].size);
+	}
+
+	if(pool->table.memory != NULL) {
+		munmap(pool->table.memory, pool->table.size);
+	}
+
+	free(pool->work_queue.items);
+
+	for(size_t i = 0; i < pool->ngroups; ++i) {
+		free(pool->group_queues[i].items);
+	}
+
+	free(pool->group_queues);
+	free(pool->group_weights);
+
+	for(size_t i = 0; i < SLAB_CLASSES; ++i) {
+		slab_chunk_t *chunk = pool->slabs[i].chunks;
+
+		while(chunk != NULL) {
+			slab_chunk_t *next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+	}
 
 	free(pool->served_actor);
 	free(pool->threads);
@@ -149,42 +503,31 @@ static void thread_pool_destroy() {
 	pool = NULL;
 }
 
+/* Only records shutdown request, as little is async-signal-safe; shutdown
+ * itself is done by watcher thread.
+ */
 static void catch(__attribute__((unused)) int signal, 
 				  __attribute__((unused)) siginfo_t *info, 
 				  __attribute__((unused)) void *more) {
 
-	if(pool == NULL) {
-		return;
-	}
-	else {
-
-		mutex_lock(&pool->mutex);
-		pool->shutdown = true;
-
-		if(pool->waiting_threads > 0) {
-			cond_signal(&pool->await_cond);
-			mutex_unlock(&pool->mutex);
-			mutex_lock(&pool->mutex);
-		}
+	int saved_errno = errno;
+	int fd = shutdown_fd;
+	char request = SHUTDOWN_REQUEST;
 
-		if(!(pool->active_join)) {
-			mutex_unlock(&pool->mutex);
-			thread_pool_destroy();
-		}
-		else {
-			cond_signal(&pool->finish_cond);
-			mutex_unlock(&pool->mutex);
-		}
+	if(fd >= 0 && write(fd, &request, 1) < 0) {
+		/* Pipe is full, so shutdown is already requested */
 	}
+
+	errno = saved_errno;
 }
 
-static void append_to_queue(actor_id_t target_id) {
-	size_t current_size = pool->work_queue_size;
-	size_t current_iter = pool->work_queue_iter;
+static void run_queue_push(run_queue_t *queue, size_t target_id) {
+	size_t current_size = queue->size;
+	size_t current_iter = queue->iter;
 
-	if(pool->work_queue_count == current_size - 1) {
+	if(queue->count == current_size - 1) {
 
-		void *realloc_ptr = realloc(pool->work_queue,
+		void *realloc_ptr = realloc(queue->items,
 									2 * current_size * sizeof(size_t));
 
 		if(realloc_ptr == NULL) {
@@ -192,36 +535,87 @@ static void append_to_queue(actor_id_t target_id) {
 			exit(1);
 		}
 
-		pool->work_queue = (size_t *) realloc_ptr;
+		queue->items = (size_t *) realloc_ptr;
 
-		for(size_t i = 0; i < pool->work_queue_iter; ++i) {
-			pool->work_queue[current_size + i] = pool->work_queue[i];
+		for(size_t i = 0; i < queue->iter; ++i) {
+			queue->items[current_size + i] = queue->items[i];
 		}
 
 		for(size_t i = 0; i < current_size; ++i) {
-			pool->work_queue[i] = pool->work_queue[i + current_iter];
+			queue->items[i] = queue->items[i + current_iter];
 		}
 
-		pool->work_queue_size = 2 * current_size;
-		pool->work_queue_iter = 0;
+		queue->size = 2 * current_size;
+		queue->iter = 0;
 	}
 
-	size_t pos = (pool->work_queue_iter + pool->work_queue_count) % (pool->work_queue_size);
-	pool->work_queue[pos] = target_id;
-	pool->work_queue_count++;
+	size_t pos = (queue->iter + queue->count) % (queue->size);
+	queue->items[pos] = target_id;
+	queue->count++;
 }
 
-static actor_id_t queue_pop() {
-	actor_id_t current = pool->work_queue[pool->work_queue_iter];
-	
-	pool->work_queue_iter = (pool->work_queue_iter + 1) % (pool->work_queue_size);
-	pool->work_queue_count--;
+static size_t run_queue_pop_front(run_queue_t *queue) {
+	size_t current = queue->items[queue->iter];
+
+	queue->iter = (queue->iter + 1) % (queue->size);
+	queue->count--;
 
 	return current;
 }
 
+static size_t run_queue_pop_back(run_queue_t *queue) {
+	queue->count--;
+
+	return queue->items[(queue->iter + queue->count) % queue->size];
+}
+
+static void append_to_queue(actor_id_t target_id) {
+	if(pool->scheduler == SCHEDULE_WEIGHTED) {
+		size_t group = pool->actor_roles[target_id]->group % pool->ngroups;
+
+		run_queue_push(&pool->group_queues[group], target_id);
+	}
+	else {
+		run_queue_push(&pool->work_queue, target_id);
+	}
+}
+
+/* Picks next actor to serve according to scheduler; some actor has to be
+ * waiting in queues.
+ */
+static actor_id_t queue_pop() {
+	switch(pool->scheduler) {
+		case SCHEDULE_LIFO:
+			if(++pool->pops % LIFO_FAIRNESS == 0) {
+				return run_queue_pop_front(&pool->work_queue);
+			}
+
+			return run_queue_pop_back(&pool->work_queue);
+
+		case SCHEDULE_WEIGHTED:
+			while(true) {
+				run_queue_t *queue = &pool->group_queues[pool->current_group];
+
+				if(queue->count > 0 && pool->group_credit > 0) {
+					pool->group_credit--;
+					return run_queue_pop_front(queue);
+				}
+
+				pool->current_group = (pool->current_group + 1) % pool->ngroups;
+				pool->group_credit = pool->group_weights[pool->current_group];
+			}
+
+		case SCHEDULE_FIFO:
+		default:
+			return run_queue_pop_front(&pool->work_queue);
+	}
+}
+
 static size_t map_thread_to_index() {
-	size_t index;
+#ifdef SINGLE_WORKER
+	return 0;
+#else
+	size_t index = 0;
 
 	for(size_t i = 0; i < POOL_SIZE; ++i) {
 		if(pthread_equal(pthread_self(), pool->threads[i])) {
@@ -230,96 +624,279 @@ static size_t map_thread_to_index() {
 	}
 
 	return index;
+#endif
 }
 
-static void handle_godie_msg(size_t actor_id) {
-	pool->actor_status[actor_id] = dead;
-	mutex_unlock(&pool->mutex);
+static size_t slab_class_of(size_t size) {
+	size_t class = 0;
+
+	while(class < SLAB_CLASSES && (SLAB_MIN_SIZE << class) < size) {
+		class++;
+	}
+
+	return class;
 }
 
-static void reallocate_arrays() {
-	size_t old_size = pool->arrays_size;
+static void *slab_alloc(size_t size) {
+	size_t class = slab_class_of(size);
 
-	if(old_size == CAST_LIMIT) {
-		perror("Error: CAST_LIMIT; can't create new actor - terminating...");
-		exit(1);
+	if(class == SLAB_CLASSES) {
+		return malloc(size);
 	}
 
-	void *alloc_ptr;
+	slab_class_t *slab = &pool->slabs[class];
 
-	if((alloc_ptr = realloc(pool->message_queues, 2*old_size*ACTOR_QUEUE_LIMIT*sizeof(message_t *))) == NULL) {
+	if(slab->free_list == NULL) {
+		size_t object_size = SLAB_MIN_SIZE << class;
+		size_t header_size = (sizeof(slab_chunk_t) + SLAB_MIN_SIZE - 1) & ~(SLAB_MIN_SIZE - 1);
+		char *chunk = malloc(header_size + SLAB_CHUNK_OBJECTS * object_size);
 
-		perror("Critical: realloc");
-		exit(1);
+		if(chunk == NULL) {
+			return NULL;
+		}
+
+		((slab_chunk_t *) chunk)->next = slab->chunks;
+		slab->chunks = (slab_chunk_t *) chunk;
+
+		for(size_t i = SLAB_CHUNK_OBJECTS; i > 0; --i) {
+			slab_object_t *object = (slab_object_t *) (chunk + header_size + (i - 1) * object_size);
+			object->next = slab->free_list;
+			slab->free_list = object;
+		}
 	}
-	pool->message_queues = alloc_ptr;
 
-	if((alloc_ptr = realloc(pool->actor_roles, 2*old_size*sizeof(role_t *))) == NULL) {
-					
-		perror("Critical: realloc");
-		exit(1);
+	slab_object_t *object = slab->free_list;
+	slab->free_list = object->next;
+
+	return object;
+}
+
+static void slab_free(void *ptr, size_t size) {
+	size_t class = slab_class_of(size);
+
+	if(class == SLAB_CLASSES) {
+		free(ptr);
+		return;
 	}
-	pool->actor_roles = alloc_ptr;
 
-	if((alloc_ptr = realloc(pool->messages_in_queue, 2*old_size*sizeof(size_t))) == NULL) {
-					
-		perror("Critical: realloc");
-		exit(1);
+	slab_object_t *object = (slab_object_t *) ptr;
+	object->next = pool->slabs[class].free_list;
+	pool->slabs[class].free_list = object;
+}
+
+/* Sets up runtime-managed state of freshly created actor, if its role
+ * declares one. Called with pool mutex held, so state_init runs under it
+ * too; it can not be called after unlocking, as actor may be scheduled by
+ * then.
+ */
+static void allocate_state(size_t actor_id) {
+	role_t *role = pool->actor_roles[actor_id];
+
+	pool->actor_state_ptr[actor_id] = NULL;
+
+	if(role->state_size == 0) {
+		return;
 	}
-	pool->messages_in_queue = alloc_ptr;
 
-	if((alloc_ptr = realloc(pool->actor_status, 2*old_size*sizeof(size_t))) == NULL) {
-					
-		perror("Critical: realloc");
+	void *state = slab_alloc(role->state_size);
+
+	if(state == NULL) {
+		perror("Critical: malloc");
 		exit(1);
 	}
-	pool->actor_status = alloc_ptr;
-	
-	if((alloc_ptr = realloc(pool->queue_iterators, 2*old_size*sizeof(size_t))) == NULL) {
 
-		perror("Critical: realloc");
-		exit(1);
+	memset(state, 0, role->state_size);
+
+	if(role->state_init != NULL) {
+		role->state_init(state);
 	}
-	pool->queue_iterators = alloc_ptr;
 
-	if((alloc_ptr = realloc(pool->actor_state_ptr, 2*old_size*sizeof(void *))) == NULL) {
+	pool->actor_state_ptr[actor_id] = state;
+}
 
-		perror("Critical: realloc");
-		exit(1);
+/* Returns runtime-managed state of dead actor with drained queue back to
+ * its slab. Called with pool mutex held, which slabs rely on, so
+ * state_destroy runs under it too.
+ */
+static void reclaim_state(size_t actor_id) {
+	role_t *role = pool->actor_roles[actor_id];
+	void *state = pool->actor_state_ptr[actor_id];
+
+	if(role->state_size == 0 || state == NULL) {
+		return;
 	}
-	pool->actor_state_ptr = alloc_ptr;
 
-	if((alloc_ptr = realloc(pool->work_state, 2*old_size*sizeof(size_t))) == NULL) {
-		perror("Critical: realloc");
-		exit(1);
+	if(role->state_destroy != NULL) {
+		role->state_destroy(state);
+	}
+
+	slab_free(state, role->state_size);
+	pool->actor_state_ptr[actor_id] = NULL;
+}
+
+/* Wraps position in mailbox, which is less than twice mailbox size */
+static size_t mailbox_wrap(size_t pos) {
+	return pos < pool->mailbox_size ? pos : pos - pool->mailbox_size;
+}
+
+static unsigned long long monotonic_now() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long) now.tv_sec * 1000000000ull + (unsigned long long) now.tv_nsec;
+}
+
+static bool is_expired(message_t *message) {
+	return message->deadline != 0 && message->message_type != MSG_SPAWN &&
+		   message->message_type != MSG_GODIE && monotonic_now() >= message->deadline;
+}
+
+/* Counts message dropped from mailbox of actor, unless counter is NULL,
+ * and passes it to drop hook. Called with pool lock held.
+ */
+static void drop_message(size_t actor_id, message_t *message, size_t *counter) {
+	if(counter != NULL) {
+		__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	}
+
+	if(pool->drop_hook != NULL) {
+		pool->drop_hook(ACTOR_ID(local_node, actor_id), message);
+	}
+}
+
+static void handle_expired_msg(size_t actor_id, message_t *message) {
+	drop_message(actor_id, message, &expired_messages);
+	worker_unlock();
+}
+
+static void handle_godie_msg(size_t actor_id) {
+	pool->actor_status[actor_id] = dead;
+	worker_unlock();
+}
+
+static size_t align_to(size_t size, size_t alignment) {
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+/* Maps zeroed memory, committed only once touched. Explicit huge pages
+ * fall back to transparent ones when none are reserved in system.
+ */
+static int map_region(region_t *region, size_t size, huge_pages_t huge_pages) {
+	if(huge_pages == HUGE_PAGES_EXPLICIT) {
+		region->size = align_to(size, HUGE_PAGE_SIZE);
+		region->memory = mmap(NULL, region->size, PROT_READ | PROT_WRITE,
+							  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if(region->memory != MAP_FAILED)
+			return success;
+	}
+
+	region->size = size;
+	region->memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+						  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if(region->memory == MAP_FAILED) {
+		region->memory = NULL;
+		return memory_error;
 	}
-	pool->work_state = alloc_ptr;
-	
-	for(size_t i = old_size; i < 2*old_size; ++i) {
+
+	if(huge_pages != HUGE_PAGES_NONE)
+		madvise(region->memory, size, MADV_HUGEPAGE);
+
+	return success;
+}
+
+/* Reserves actor table for CAST_LIMIT actors; explicit huge pages would
+ * have to be committed for all of it up front, so table uses transparent
+ * ones instead.
+ */
+static int map_table() {
+	size_t stride = align_to(CAST_LIMIT * sizeof(void *), HUGE_PAGE_SIZE);
+	huge_pages_t huge_pages = pool->huge_pages == HUGE_PAGES_NONE ? HUGE_PAGES_NONE :
+																	HUGE_PAGES_TRANSPARENT;
+
+	if(map_region(&pool->table, TABLE_ARRAYS * stride, huge_pages) != success)
+		return memory_error;
+
+	char *base = pool->table.memory;
+
+	pool->actor_status = (size_t *) (base + 0 * stride);
+	pool->work_state = (size_t *) (base + 1 * stride);
+	pool->queue_iterators = (size_t *) (base + 2 * stride);
+	pool->messages_in_queue = (size_t *) (base + 3 * stride);
+	pool->message_queues = (message_t ***) (base + 4 * stride);
+	pool->actor_roles = (role_t **) (base + 5 * stride);
+	pool->actor_state_ptr = (void **) (base + 6 * stride);
+	pool->routers = (router_t **) (base + 7 * stride);
+	pool->coroutines = (coroutine_t **) (base + 8 * stride);
+
+	return success;
+}
+
+/* Gives actors with ids in [first, last) empty mailboxes carved out of
+ * newly mapped region and resets their table entries.
+ */
+static int add_actors(size_t first, size_t last) {
+	if(pool->mailbox_regions == MAILBOX_REGIONS)
+		return memory_error;
+
+	region_t *region = &pool->mailboxes[pool->mailbox_regions];
+
+	if(map_region(region, (last - first) * pool->mailbox_size * sizeof(message_t *),
+				  pool->huge_pages) != success)
+		return memory_error;
+
+	pool->mailbox_regions++;
+
+	message_t **mailbox = region->memory;
+
+	for(size_t i = first; i < last; ++i) {
 		pool->actor_status[i] = uninitialised;
+		pool->work_state[i] = waiting;
 		pool->queue_iterators[i] = 0;
 		pool->messages_in_queue[i] = 0;
+		pool->message_queues[i] = mailbox + (i - first) * pool->mailbox_size;
+		pool->actor_roles[i] = NULL;
 		pool->actor_state_ptr[i] = NULL;
+		pool->routers[i] = NULL;
+		pool->coroutines[i] = NULL;
+	}
 
-		if((pool->message_queues[i] = malloc(ACTOR_QUEUE_LIMIT * sizeof(message_t *))) == NULL) {
-			perror("Critical: malloc");
-			exit(1);
-		}
+	return success;
+}
+
+/* Doubles number of actors table is set up for. Nothing is copied, so
+ * workers are held only for mapping and resetting new entries.
+ */
+static void grow_arrays() {
+	size_t old_size = pool->arrays_size;
+
+	if(old_size == CAST_LIMIT) {
+		perror("Error: CAST_LIMIT; can't create new actor - terminating...");
+		exit(1);
+	}
+
+	size_t new_size = (2*old_size < CAST_LIMIT) ? 2*old_size : CAST_LIMIT;
+
+	if(add_actors(old_size, new_size) != success) {
+		perror("Critical: mmap");
+		exit(1);
 	}
 
-	pool->arrays_size = 2*old_size;
+	pool->arrays_size = new_size;
 }
 
 static void handle_spawn_msg(message_t *acquired_message) {
 
 	if(pool->actors_count == CAST_LIMIT) {
-		mutex_unlock(&pool->mutex);
+		worker_unlock();
 		return;
 	}
 
 	if(pool->actors_count == pool->arrays_size) {
 
-		reallocate_arrays();
+		grow_arrays();
 	}
 
 	size_t new_actor_id = pool->actors_count;
@@ -327,7 +904,10 @@ static void handle_spawn_msg(message_t *acquired_message) {
 	pool->actor_status[new_actor_id] = alive;
 	pool->actor_roles[new_actor_id] = acquired_message->data;
 
-	pool->actors_count++;
+	allocate_state(new_actor_id);
+
+	/* Atomic, as outbox_push reads count without pool lock */
+	__atomic_add_fetch(&pool->actors_count, 1, __ATOMIC_RELAXED);
 	pool->alive_actors++;
 
 	message_t *message = malloc(sizeof(message_t));
@@ -339,7 +919,9 @@ static void handle_spawn_msg(message_t *acquired_message) {
 	}
 
 	message->message_type = MSG_HELLO;
+	message->nbytes = 0;
 	message->data = (void *) actor_id_self();
+	message->deadline = 0;
 
 	pool->message_queues[new_actor_id][0] = message;
 	pool->messages_in_queue[new_actor_id] = 1;
@@ -354,367 +936,2486 @@ static void handle_spawn_msg(message_t *acquired_message) {
 		cond_signal(&pool->await_cond);
 	}
 
-	mutex_unlock(&pool->mutex);
+	worker_unlock();
 }
 
-static void handle_other_msg(size_t actor_id, message_t *message) {
-
-	act_t fun = pool->actor_roles[actor_id]->prompts[message->message_type];
+#ifdef CACTI_PROFILE
+
+#define PROFILE_COUNTERS 4
+
+static const struct {
+	unsigned type;
+	unsigned long long config;
+} profile_events[PROFILE_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES }
+};
+
+static const char *profile_names[PROFILE_COUNTERS] = {
+	"cycles", "instructions", "llc-misses", "ctx-switches"
+};
+
+typedef struct profile_entry {
+	role_t *role;
+	message_type_t message_type;
+	unsigned long long calls;
+	unsigned long long nanoseconds;
+	unsigned long long counters[PROFILE_COUNTERS];
+} profile_entry_t;
+
+typedef struct profile_table {
+	size_t count;
+	size_t size;
+	profile_entry_t *entries;
+} profile_table_t;
+
+/* Counters of this worker; fds[i] is -1 when event could not be opened,
+ * position[i] is index of its value in group read */
+typedef struct profiler {
+	bool initialised;
+	int leader;
+	int fds[PROFILE_COUNTERS];
+	size_t position[PROFILE_COUNTERS];
+	size_t opened;
+	profile_table_t table;
+} profiler_t;
+
+typedef struct profile_sample {
+	struct timespec time;
+	unsigned long long counters[PROFILE_COUNTERS];
+} profile_sample_t;
+
+static __thread profiler_t profiler = { .initialised = false };
+
+/* Tables of finished workers, merged under pool mutex */
+static profile_table_t global_profile = { 0, 0, NULL };
+static bool profile_available[PROFILE_COUNTERS];
+
+static void profiler_init() {
+	profiler.initialised = true;
+	profiler.leader = -1;
+	profiler.opened = 0;
+
+	for(size_t i = 0; i < PROFILE_COUNTERS; ++i) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = profile_events[i].type;
+		attr.config = profile_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_hv = 1;
+
+		/* Context switches happen in kernel, so excluding it would leave
+		 * software counter at zero; when kernel counting is not allowed
+		 * the event is refused and its column shows '-' */
+		attr.exclude_kernel = profile_events[i].type == PERF_TYPE_HARDWARE;
+
+		profiler.fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, profiler.leader, 0);
+
+		if(profiler.fds[i] < 0) {
+			profiler.fds[i] = -1;
+			continue;
+		}
 
-	mutex_unlock(&pool->mutex);
+		if(profiler.leader < 0) {
+			profiler.leader = profiler.fds[i];
+		}
 
-	(*fun)(&pool->actor_state_ptr[actor_id], 0, message->data);
+		profiler.position[i] = profiler.opened++;
+	}
 }
 
-/* Function executed by each thread in pool
- */
-static void *thread_action(void *pool) {
-
-	thread_pool_t *pool_ptr = (thread_pool_t *) pool;
-	message_t *acquired_message;
-	size_t current_actor;
-
-	struct sigaction action;
-	sigset_t block_mask;
-	sigemptyset(&block_mask);
+static void profile_read(profile_sample_t *sample) {
+	unsigned long long values[1 + PROFILE_COUNTERS];
 
-	action.sa_sigaction = catch;
-	action.sa_mask = block_mask;
-	action.sa_flags = SA_SIGINFO;
+	memset(sample->counters, 0, sizeof(sample->counters));
 
-	if(sigaction(SIGINT, &action, NULL) != 0) {
-		perror("Initialising sigaction failed.");
-		exit(1);
+	if(profiler.leader >= 0 && read(profiler.leader, values, sizeof(values)) > 0) {
+		for(size_t i = 0; i < PROFILE_COUNTERS; ++i) {
+			if(profiler.fds[i] >= 0) {
+				sample->counters[i] = values[1 + profiler.position[i]];
+			}
+		}
 	}
 
-	while(true) {
-		mutex_lock(&pool_ptr->mutex);
-
-		if(pool_ptr->shutdown) {
+	clock_gettime(CLOCK_MONOTONIC, &sample->time);
+}
 
-			break;
-		}
+static void profile_begin(profile_sample_t *sample) {
+	if(!profiler.initialised) {
+		profiler_init();
+	}
 
-		pool_ptr->waiting_threads++;
+	profile_read(sample);
+}
 
-		while(pool_ptr->actors_to_serve == 0 && !pool_ptr->shutdown) {
-			cond_wait(&pool_ptr->await_cond, &pool_ptr->mutex);
+static profile_entry_t *profile_find(profile_table_t *table, role_t *role, message_type_t message_type) {
+	for(size_t i = 0; i < table->count; ++i) {
+		if(table->entries[i].role == role && table->entries[i].message_type == message_type) {
+			return &table->entries[i];
 		}
+	}
 
-		pool_ptr->waiting_threads--;
-
-		if(pool_ptr->shutdown) {
+	if(table->count == table->size) {
+		size_t size = table->size == 0 ? 16 : 2 * table->size;
+		void *alloc_ptr = realloc(table->entries, size * sizeof(profile_entry_t));
 
-			break;
+		if(alloc_ptr == NULL) {
+			perror("Critical: realloc");
+			exit(1);
 		}
 
-		current_actor = queue_pop();
+		table->entries = alloc_ptr;
+		table->size = size;
+	}
 
-		pool_ptr->waiting_messages--;
-		pool_ptr->actors_to_serve--;
+	profile_entry_t *entry = &table->entries[table->count++];
 
-		pool_ptr->served_actor[map_thread_to_index()] = current_actor;
+	memset(entry, 0, sizeof(profile_entry_t));
+	entry->role = role;
+	entry->message_type = message_type;
 
-		acquired_message = pool_ptr->message_queues[current_actor][pool_ptr->queue_iterators[current_actor]];
+	return entry;
+}
 
-		/* Update queue of actor */
-		pool_ptr->queue_iterators[current_actor] = (pool_ptr->queue_iterators[current_actor] + 1) % 
-													ACTOR_QUEUE_LIMIT;
+static void profile_end(role_t *role, message_type_t message_type, profile_sample_t *start) {
+	profile_sample_t end;
+	profile_read(&end);
 
+	profile_entry_t *entry = profile_find(&profiler.table, role, message_type);
 
-		pool_ptr->messages_in_queue[current_actor]--;
+	entry->calls++;
+	entry->nanoseconds += (unsigned long long) ((end.time.tv_sec - start->time.tv_sec) * 1000000000LL +
+												(end.time.tv_nsec - start->time.tv_nsec));
 
-		pool_ptr->work_state[current_actor] = working;
+	for(size_t i = 0; i < PROFILE_COUNTERS; ++i) {
+		entry->counters[i] += end.counters[i] - start->counters[i];
+	}
+}
 
-		bool check_dead = (pool_ptr->actor_status[current_actor] == dead || 
-						   acquired_message->message_type == MSG_GODIE);
+/* Moves table of exiting worker into global one. Called with pool mutex held. */
+static void profile_merge() {
+	for(size_t i = 0; i < profiler.table.count; ++i) {
+		profile_entry_t *source = &profiler.table.entries[i];
+		profile_entry_t *target = profile_find(&global_profile, source->role, source->message_type);
 
-		if(pool_ptr->messages_in_queue[current_actor] == 0 && 
-		   check_dead) {
+		target->calls += source->calls;
+		target->nanoseconds += source->nanoseconds;
 
-			pool_ptr->alive_actors--;
+		for(size_t j = 0; j < PROFILE_COUNTERS; ++j) {
+			target->counters[j] += source->counters[j];
 		}
+	}
 
-		/* Process message */
-
-		if(acquired_message->message_type == MSG_GODIE) {
-
-			handle_godie_msg(current_actor);
+	for(size_t i = 0; i < PROFILE_COUNTERS && profiler.initialised; ++i) {
+		if(profiler.fds[i] >= 0) {
+			profile_available[i] = true;
+			close(profiler.fds[i]);
 		}
-		else if(acquired_message->message_type == MSG_SPAWN) {
+	}
 
-			handle_spawn_msg(acquired_message);
-		}
-		else if(acquired_message->message_type >= 0 &&
-				(size_t) acquired_message->message_type < pool_ptr->actor_roles[current_actor]->nprompts) {
+	free(profiler.table.entries);
+	profiler.initialised = false;
+	profiler.table = (profile_table_t) { 0, 0, NULL };
+}
 
-			handle_other_msg(current_actor, acquired_message);
-		}
-		else {
-			perror("Critical: unknown message type - terminating...");
-			exit(1);
-		}
+static int profile_compare(const void *left, const void *right) {
+	const profile_entry_t *a = left, *b = right;
 
-		free(acquired_message);
+	if(a->counters[0] != b->counters[0])
+		return a->counters[0] < b->counters[0] ? 1 : -1;
 
-		/* Update working status and wake threads if there is need to */
+	if(a->nanoseconds != b->nanoseconds)
+		return a->nanoseconds < b->nanoseconds ? 1 : -1;
 
-		mutex_lock(&pool_ptr->mutex);
+	return 0;
+}
 
+static void profile_report() {
+	qsort(global_profile.entries, global_profile.count, sizeof(profile_entry_t), profile_compare);
 
-		pool_ptr->work_state[current_actor] = waiting;
+	fprintf(stderr, "%-18s %10s %12s %12s", "role", "type", "calls", "time[us]");
 
-		if(pool_ptr->messages_in_queue[current_actor] > 0) {
+	for(size_t i = 0; i < PROFILE_COUNTERS; ++i) {
+		fprintf(stderr, " %14s", profile_names[i]);
+	}
 
-			append_to_queue(current_actor);
-			pool_ptr->actors_to_serve++;
+	fprintf(stderr, "\n");
 
-			if(pool_ptr->waiting_threads > 0) {
+	for(size_t i = 0; i < global_profile.count; ++i) {
+		profile_entry_t *entry = &global_profile.entries[i];
 
-				cond_signal(&pool_ptr->await_cond);
-			}
+		if(entry->role->name != NULL) {
+			fprintf(stderr, "%-18s", entry->role->name);
+		}
+		else {
+			fprintf(stderr, "%-18p", (void *) entry->role);
 		}
 
-		if(pool_ptr->alive_actors == 0) {
+		fprintf(stderr, " %10ld %12llu %12llu", entry->message_type,
+				entry->calls, entry->nanoseconds / 1000);
 
-			pool_ptr->shutdown = true;
-			cond_signal(&pool_ptr->await_cond);
+		for(size_t j = 0; j < PROFILE_COUNTERS; ++j) {
+			if(profile_available[j]) {
+				fprintf(stderr, " %14llu", entry->counters[j]);
+			}
+			else {
+				fprintf(stderr, " %14s", "-");
+			}
 		}
 
-		mutex_unlock(&pool_ptr->mutex);
+		fprintf(stderr, "\n");
 	}
 
-	pool_ptr->working_count--;
+	free(global_profile.entries);
+	global_profile = (profile_table_t) { 0, 0, NULL };
+	memset(profile_available, 0, sizeof(profile_available));
+}
 
-	if(pool_ptr->working_count > 0) {
-		cond_signal(&pool_ptr->await_cond);
-		mutex_unlock(&pool_ptr->mutex);
-	}
-	else {
-		cond_signal(&pool_ptr->finish_cond);
-		mutex_unlock(&pool_ptr->mutex);
+#endif
+
+/* Coroutine of handler currently run by this thread */
+static __thread coroutine_t *current_coroutine = NULL;
+
+/* Finished coroutines kept by this thread together with their stacks */
+static __thread coroutine_t *spare_coroutines = NULL;
+static __thread size_t spare_count = 0;
+
+#ifdef FAST_SWITCH
+
+/* Saves callee-saved registers, together with MXCSR and x87 control word,
+ * on current stack, stores stack pointer in *from and continues on stack
+ * to. Unlike swapcontext, signal mask is left alone, so switch costs no
+ * system call. */
+void cacti_switch(void **from, void *to) __attribute__((visibility("hidden")));
+
+__asm__(
+	".text\n"
+	".globl cacti_switch\n"
+	".hidden cacti_switch\n"
+	".type cacti_switch, @function\n"
+	"cacti_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cacti_switch, .-cacti_switch\n"
+);
+
+#define switch_context(from, to) cacti_switch((from), *(to))
+
+#else
+
+static void switch_context(ucontext_t *from, ucontext_t *to) {
+	if(swapcontext(from, to) != 0) {
+		perror("Critical: swapcontext");
+		exit(1);
 	}
-
-	return NULL;
 }
 
-#define DEFAULT_SIZE 512
+#endif
 
-static int thread_pool_init() {
-	int err;
+/* Runs handlers given to coroutine one after another; finished coroutine
+ * is resumed here when reused for next handler. */
+static void coroutine_entry() {
+	coroutine_t *coroutine = current_coroutine;
 
-	if(pool == NULL)
-		return null_pointer;
+	while(true) {
+		coroutine->fun(&coroutine->state, coroutine->nbytes, coroutine->data);
+		coroutine->finished = true;
 
-	if(pthread_attr_init(&pool->attr))
-		return attr_init_error;
+		/* Thread may differ from the one that started handler */
+		switch_context(&coroutine->context, coroutine->caller);
+	}
+}
 
-	if((pool->threads = malloc(POOL_SIZE * sizeof(pthread_t))) == NULL)
-		return memory_error;
+/* Runs coroutine until it suspends or finishes */
+static void run_coroutine(coroutine_t *coroutine) {
+#ifdef FAST_SWITCH
+	void *caller;
+#else
+	ucontext_t caller;
+#endif
 
-	if((pool->served_actor = malloc(POOL_SIZE * sizeof(actor_id_t))) == NULL)
-		return memory_error;
+	coroutine->caller = &caller;
+	current_coroutine = coroutine;
 
-	if((pool->actor_roles = malloc(DEFAULT_SIZE * sizeof(role_t *))) == NULL)
-		return memory_error;
+	switch_context(&caller, &coroutine->context);
 
-	if((pool->actor_status = malloc(DEFAULT_SIZE * sizeof(size_t))) == NULL)
-		return memory_error;
+	current_coroutine = NULL;
+}
 
-	if((pool->actor_state_ptr = malloc(DEFAULT_SIZE * sizeof(void *))) == NULL)
-		return memory_error;
+/* Prepares fresh stack of coroutine so that first switch enters
+ * coroutine_entry */
+static void coroutine_prepare(coroutine_t *coroutine) {
+#ifdef FAST_SWITCH
+	uintptr_t top = ((uintptr_t) coroutine->stack + coroutine->stack_size) & ~(uintptr_t) 15;
+	void **frame = (void **) top;
 
-	if((pool->message_queues = malloc(DEFAULT_SIZE * sizeof(message_t **))) == NULL)
-		return memory_error;
+	*--frame = NULL;
+	*--frame = (void *) coroutine_entry;
 
-	if((pool->messages_in_queue = malloc(DEFAULT_SIZE * sizeof(size_t))) == NULL)
-		return memory_error;
+	for(int i = 0; i < 6; ++i) {
+		*--frame = NULL;
+	}
 
-	if((pool->queue_iterators = malloc(DEFAULT_SIZE * sizeof(size_t))) == NULL)
-		return memory_error;
+	/* Default MXCSR and x87 control word, in layout of cacti_switch */
+	*--frame = (void *) (((uintptr_t) 0x037f << 32) | 0x1f80);
 
-	if((pool->work_state = malloc(DEFAULT_SIZE * sizeof(size_t))) == NULL)
-		return memory_error;
+	coroutine->context = frame;
+#else
+	if(getcontext(&coroutine->context) != 0) {
+		perror("Critical: coroutine");
+		exit(1);
+	}
 
-	if((pool->work_queue = malloc(DEFAULT_SIZE * sizeof(size_t))) == NULL)
-		return memory_error;
+	coroutine->context.uc_stack.ss_sp = coroutine->stack;
+	coroutine->context.uc_stack.ss_size = coroutine->stack_size;
+	coroutine->context.uc_link = NULL;
 
-	for(size_t i = 0; i < DEFAULT_SIZE; ++i)
-		if((pool->message_queues[i] = malloc(ACTOR_QUEUE_LIMIT * sizeof(message_t *))) == NULL)
-			return memory_error;
+	makecontext(&coroutine->context, coroutine_entry, 0);
+#endif
+}
 
-	for(size_t i = 0; i < DEFAULT_SIZE; ++i) {
-		pool->actor_status[i] = uninitialised;
-		pool->queue_iterators[i] = 0;
-		pool->messages_in_queue[i] = 0;
-		pool->actor_roles[i] = NULL;
-		pool->actor_state_ptr[i] = NULL;
-		pool->work_state[i] = waiting;
+static coroutine_t *coroutine_create(role_t *role, act_t fun, size_t actor_id, message_t *message) {
+	coroutine_t **link = &spare_coroutines;
+
+	while(*link != NULL && (*link)->stack_size != role->stack_size) {
+		link = &(*link)->next;
 	}
 
-	for(size_t i = 0; i < POOL_SIZE; ++i) {
-		pool->served_actor[i] = 0;
+	coroutine_t *coroutine = *link;
+
+	if(coroutine != NULL) {
+		*link = coroutine->next;
+		spare_count--;
 	}
+	else {
+		coroutine = malloc(sizeof(coroutine_t));
 
-	pool->arrays_size = DEFAULT_SIZE;
-	pool->pool_size = POOL_SIZE;
-	pool->actors_count = 0;
-	pool->waiting_messages = 0;
-	pool->waiting_threads = 0;
-	pool->actors_to_serve = 0;
-	pool->work_queue_size = DEFAULT_SIZE;
-	pool->work_queue_iter = 0;
-	pool->work_queue_count = 0;
-	pool->working_count = POOL_SIZE;
-	pool->alive_actors = 0;
-	pool->shutdown = false;
-	pool->active_join = false;
+		if(coroutine == NULL || (coroutine->stack = malloc(role->stack_size)) == NULL) {
+			perror("Critical: coroutine");
+			exit(1);
+		}
 
-	if((err = pthread_mutex_init(&pool->mutex, NULL)) != 0)
-		return mutex_init_error;
+		coroutine->stack_size = role->stack_size;
+		coroutine_prepare(coroutine);
+	}
 
-	if((err = pthread_cond_init(&pool->await_cond, NULL)) != 0)
-		return cond_init_error;
+	coroutine->actor = actor_id;
+	coroutine->fun = fun;
+	coroutine->state = pool->actor_state_ptr[actor_id];
+	coroutine->nbytes = message->nbytes;
+	coroutine->data = message->data;
+	coroutine->finished = false;
+	coroutine->cancelled = false;
+	coroutine->resume = NULL;
 
-	if((err = pthread_cond_init(&pool->finish_cond, NULL)) != 0)
-		return cond_init_error;
+	return coroutine;
+}
 
-	for(size_t i = 0; i < POOL_SIZE; i++) {
-		if((err = pthread_create(&pool->threads[i], &pool->attr, thread_action, (void *) pool)) != 0) {
-			thread_pool_destroy();
-			return pthread_create_error;
-		}
+/* Keeps finished coroutine for reuse by this thread */
+static void coroutine_release(coroutine_t *coroutine) {
+	if(spare_count == SPARE_COROUTINES) {
+		free(coroutine->stack);
+		free(coroutine);
+		return;
 	}
 
-	return success;
+	coroutine->next = spare_coroutines;
+	spare_coroutines = coroutine;
+	spare_count++;
 }
 
-/************************************************************************************/
-/*																					*/
-/*																					*/
-/*									ACTORS SYSTEM 									*/
-/*																					*/
-/*																					*/
-/************************************************************************************/
+static void free_spare_coroutines() {
+	while(spare_coroutines != NULL) {
+		coroutine_t *next = spare_coroutines->next;
 
-actor_id_t actor_id_self() {
+		free(spare_coroutines->stack);
+		free(spare_coroutines);
+		spare_coroutines = next;
+	}
 
-	return pool->served_actor[map_thread_to_index()];
+	spare_count = 0;
 }
 
-void actor_system_join(actor_id_t actor) {
+int actor_await(message_type_t message_type, message_t *message) {
+	coroutine_t *coroutine = current_coroutine;
 
-	if(pool == NULL){
-		return;
-	}
+	if(coroutine == NULL || message == NULL ||
+	   message_type == MSG_SPAWN || message_type == MSG_GODIE)
+		return -1;
 
-	mutex_lock(&pool->mutex);
+	/* Dead actor gets no more messages */
+	worker_lock();
+	bool dead_actor = pool->actor_status[coroutine->actor] == dead;
+	worker_unlock();
 
-	if((size_t) actor >= pool->actors_count) {
-		mutex_unlock(&pool->mutex);
-		perror("Actor with specified id does not exist...");
-		return;
-	}
+	if(dead_actor)
+		return -1;
 
-	pool->active_join = true;
+	coroutine->awaited = message_type;
 
-	while(true) {
+	switch_context(&coroutine->context, coroutine->caller);
 
-		if(pool->working_count > 0) {
+	if(coroutine->cancelled) {
+		coroutine->cancelled = false;
+		return -1;
+	}
 
-			cond_wait(&pool->finish_cond, &pool->mutex);
-		}
-		else {
+	*message = coroutine->received;
 
-			break;
-		}
-	}
+	return 0;
+}
 
-	pool->active_join = false;
-	mutex_unlock(&pool->mutex);
-	thread_pool_destroy();
+/* Resumes suspended actor without message, so that its await fails and
+ * queued MSG_GODIE is reached. Called with pool lock held.
+ */
+static void cancel_await(size_t actor_id) {
+	pool->coroutines[actor_id]->cancelled = true;
+	pool->waiting_messages++;
+
+	append_to_queue(actor_id);
+	pool->actors_to_serve++;
+
+	wake_worker();
 }
 
-int send_message(actor_id_t actor, message_t message) {
-	if(pool == NULL)
-		return -1;
+/* Looks for awaited message already queued for suspended actor and
+ * schedules actor with it. Called with pool lock held.
+ */
+static void take_awaited(size_t actor_id) {
+	coroutine_t *coroutine = pool->coroutines[actor_id];
+	size_t count = pool->messages_in_queue[actor_id];
+	size_t first = pool->queue_iterators[actor_id];
+	message_t **queue = pool->message_queues[actor_id];
 
-	mutex_lock(&pool->mutex);
+	for(size_t i = 0; i < count; ++i) {
+		size_t pos = mailbox_wrap(first + i);
 
-	if(pool->shutdown) {
-		mutex_unlock(&pool->mutex);
-		return -1;
-	}
+		if(queue[pos]->message_type != coroutine->awaited) {
+			continue;
+		}
 
-	if((size_t) actor >= pool->actors_count) {
-		mutex_unlock(&pool->mutex);
-		return -2;
-	}
+		coroutine->resume = queue[pos];
 
-	if(pool->actor_status[actor] == dead) {
-		mutex_unlock(&pool->mutex);
-		return -1;
-	}
+		for(size_t j = i; j + 1 < count; ++j) {
+			queue[mailbox_wrap(first + j)] = queue[mailbox_wrap(first + j + 1)];
+		}
 
-	if(pool->messages_in_queue[actor] == ACTOR_QUEUE_LIMIT) {
-		mutex_unlock(&pool->mutex);
-		return -3;
-	}
+		pool->messages_in_queue[actor_id]--;
 
-	size_t iter = (pool->queue_iterators[actor] + pool->messages_in_queue[actor]) % ACTOR_QUEUE_LIMIT;
+		append_to_queue(actor_id);
+		pool->actors_to_serve++;
 
-	message_t *message_copy = malloc(sizeof(message_t));
+		wake_worker();
 
-	if(message_copy == NULL) {
-		mutex_unlock(&pool->mutex);
-		return -1;
+		return;
 	}
 
-	message_copy->message_type = message.message_type;
-	message_copy->nbytes = message.nbytes;
-	message_copy->data = message.data;
+	for(size_t i = 0; i < count; ++i) {
+		if(queue[mailbox_wrap(first + i)]->message_type == MSG_GODIE) {
+			cancel_await(actor_id);
+			return;
+		}
+	}
+}
 
-	pool->message_queues[actor][iter] = message_copy;
-	pool->messages_in_queue[actor]++;
-	pool->waiting_messages++;
+static void handle_other_msg(size_t actor_id, message_t *message) {
 
-	if(pool->work_state[actor] == waiting && pool->messages_in_queue[actor] == 1) {
+	role_t *role = pool->actor_roles[actor_id];
+	act_t fun = role->prompts[message->message_type];
 
-		append_to_queue(actor);
-		pool->actors_to_serve++;
+	if(role->stack_size > 0) {
+		coroutine_t *coroutine = coroutine_create(role, fun, actor_id, message);
 
-		if(pool->waiting_threads > 0) {
-			cond_signal(&pool->await_cond);
-		}
+		pool->coroutines[actor_id] = coroutine;
+		worker_unlock();
+
+#ifdef CACTI_PROFILE
+		profile_sample_t sample;
+		profile_begin(&sample);
+		run_coroutine(coroutine);
+		profile_end(role, message->message_type, &sample);
+#else
+		run_coroutine(coroutine);
+#endif
+		return;
 	}
 
-	mutex_unlock(&pool->mutex);
+	worker_unlock();
 
-	return 0;
+#ifdef CACTI_PROFILE
+	profile_sample_t sample;
+	profile_begin(&sample);
+	(*fun)(&pool->actor_state_ptr[actor_id], message->nbytes, message->data);
+	profile_end(role, message->message_type, &sample);
+#else
+	(*fun)(&pool->actor_state_ptr[actor_id], message->nbytes, message->data);
+#endif
+}
+
+/* Messages handed to batch prompt by this thread; first one is owned by
+ * caller, the rest were taken from mailbox together with it */
+static __thread message_t batch_messages[BATCH_LIMIT];
+static __thread message_t *batch_taken[BATCH_LIMIT];
+
+static bool is_batched(role_t *role, message_type_t message_type) {
+	return role->batch_prompts != NULL && role->stack_size == 0 &&
+		   message_type >= 0 && (size_t) message_type < role->nprompts &&
+		   role->batch_prompts[message_type] != NULL;
+}
+
+/* Moves messages of the same type as first that wait at front of mailbox
+ * of actor into batch and returns its size. Called with pool lock held.
+ */
+static size_t take_batch(size_t actor_id, message_t *first) {
+	size_t count = 1;
+
+	batch_messages[0] = *first;
+
+	while(count < BATCH_LIMIT && pool->messages_in_queue[actor_id] > 0) {
+		message_t *next = pool->message_queues[actor_id][pool->queue_iterators[actor_id]];
+
+		if(next->message_type != first->message_type || is_expired(next)) {
+			break;
+		}
+
+		pool->queue_iterators[actor_id] = mailbox_wrap(pool->queue_iterators[actor_id] + 1);
+		pool->messages_in_queue[actor_id]--;
+		pool->waiting_messages--;
+
+		batch_messages[count] = *next;
+		batch_taken[count] = next;
+		count++;
+	}
+
+	return count;
+}
+
+static void handle_batch_msg(size_t actor_id, size_t count) {
+
+	role_t *role = pool->actor_roles[actor_id];
+	act_batch_t fun = role->batch_prompts[batch_messages[0].message_type];
+
+	worker_unlock();
+
+#ifdef CACTI_PROFILE
+	profile_sample_t sample;
+	profile_begin(&sample);
+	(*fun)(&pool->actor_state_ptr[actor_id], count, batch_messages);
+	profile_end(role, batch_messages[0].message_type, &sample);
+#else
+	(*fun)(&pool->actor_state_ptr[actor_id], count, batch_messages);
+#endif
+
+	for(size_t i = 1; i < count; ++i) {
+		free(batch_taken[i]);
+	}
+}
+
+/* Updates working status of actor after handler gave control back and
+ * wakes threads if there is need to. Called with pool lock held.
+ */
+static void finish_turn(size_t current_actor) {
+	coroutine_t *coroutine = pool->coroutines[current_actor];
+
+	pool->active_handlers--;
+
+	if(coroutine != NULL && coroutine->finished) {
+		pool->actor_state_ptr[current_actor] = coroutine->state;
+		pool->coroutines[current_actor] = NULL;
+
+		coroutine_release(coroutine);
+	}
+	else if(coroutine != NULL) {
+		pool->actor_state_ptr[current_actor] = coroutine->state;
+		pool->work_state[current_actor] = suspended;
+
+		take_awaited(current_actor);
+
+		if(pool->quiesce_waiters > 0 && pool->active_handlers == 0 &&
+		   pool->waiting_messages == 0) {
+
+			cond_broadcast(&pool->quiesce_cond);
+		}
+
+		return;
+	}
+
+	pool->work_state[current_actor] = waiting;
+
+	if(pool->actor_status[current_actor] == dead &&
+	   pool->messages_in_queue[current_actor] == 0) {
+
+		reclaim_state(current_actor);
+	}
+
+	if(pool->messages_in_queue[current_actor] > 0) {
+
+		append_to_queue(current_actor);
+		pool->actors_to_serve++;
+
+		if(pool->waiting_threads > 0) {
+
+			cond_signal(&pool->await_cond);
+		}
+	}
+
+	if(pool->quiesce_waiters > 0 && pool->active_handlers == 0 &&
+	   pool->waiting_messages == 0) {
+
+		cond_broadcast(&pool->quiesce_cond);
+	}
+
+	if(pool->alive_actors == 0) {
+#ifdef SINGLE_WORKER
+		mutex_lock(&pool->mutex);
+		__atomic_store_n(&pool->shutdown, true, __ATOMIC_SEQ_CST);
+#else
+		pool->shutdown = true;
+#endif
+		cond_signal(&pool->await_cond);
+
+		if(pool->quiesce_waiters > 0) {
+			cond_broadcast(&pool->quiesce_cond);
+		}
+#ifdef SINGLE_WORKER
+		mutex_unlock(&pool->mutex);
+#endif
+	}
+}
+
+#ifdef SINGLE_WORKER
+static void drain_handoff();
+static void worker_sleep();
+#endif
+
+/* Function executed by each thread in pool
+ */
+static void *thread_action(void *pool) {
+
+	thread_pool_t *pool_ptr = (thread_pool_t *) pool;
+	message_t *acquired_message;
+	size_t current_actor;
+
+#ifdef USE_OUTBOX
+	outbox.active = true;
+#endif
+
+	while(true) {
+#ifdef SINGLE_WORKER
+		if(__atomic_load_n(&pool_ptr->shutdown, __ATOMIC_SEQ_CST)) {
+
+			break;
+		}
+
+		drain_handoff();
+
+		if(pool_ptr->actors_to_serve == 0) {
+
+			worker_sleep();
+			continue;
+		}
+#else
+		mutex_lock(&pool_ptr->mutex);
+
+		if(pool_ptr->shutdown) {
+
+			break;
+		}
+
+		pool_ptr->waiting_threads++;
+
+		while(pool_ptr->actors_to_serve == 0 && !pool_ptr->shutdown) {
+			cond_wait(&pool_ptr->await_cond, &pool_ptr->mutex);
+		}
+
+		pool_ptr->waiting_threads--;
+
+		if(pool_ptr->shutdown) {
+
+			break;
+		}
+#endif
+
+		current_actor = queue_pop();
+
+		pool_ptr->waiting_messages--;
+		pool_ptr->actors_to_serve--;
+		pool_ptr->active_handlers++;
+
+		pool_ptr->served_actor[map_thread_to_index()] = current_actor;
+
+		if(pool_ptr->coroutines[current_actor] != NULL) {
+
+			/* Resume suspended handler with awaited message */
+			coroutine_t *coroutine = pool_ptr->coroutines[current_actor];
+
+			/* No message when await was cancelled */
+			acquired_message = coroutine->resume;
+			coroutine->resume = NULL;
+
+			if(acquired_message != NULL) {
+				coroutine->received = *acquired_message;
+			}
+
+			coroutine->state = pool_ptr->actor_state_ptr[current_actor];
+
+			pool_ptr->work_state[current_actor] = working;
+
+			worker_unlock();
+
+#ifdef CACTI_PROFILE
+			profile_sample_t sample;
+			message_type_t awaited = coroutine->awaited;
+			profile_begin(&sample);
+			run_coroutine(coroutine);
+			profile_end(pool_ptr->actor_roles[current_actor], awaited, &sample);
+#else
+			run_coroutine(coroutine);
+#endif
+			free(acquired_message);
+
+			worker_lock();
+			flush_outbox();
+			finish_turn(current_actor);
+			worker_unlock();
+
+			continue;
+		}
+
+		acquired_message = pool_ptr->message_queues[current_actor][pool_ptr->queue_iterators[current_actor]];
+
+		/* Update queue of actor */
+		pool_ptr->queue_iterators[current_actor] = mailbox_wrap(pool_ptr->queue_iterators[current_actor] + 1);
+
+
+		pool_ptr->messages_in_queue[current_actor]--;
+
+		pool_ptr->work_state[current_actor] = working;
+
+		bool expired = is_expired(acquired_message);
+		size_t batch_count = 0;
+
+		if(!expired && is_batched(pool_ptr->actor_roles[current_actor], acquired_message->message_type)) {
+
+			batch_count = take_batch(current_actor, acquired_message);
+		}
+
+		bool check_dead = (pool_ptr->actor_status[current_actor] == dead || 
+						   acquired_message->message_type == MSG_GODIE);
+
+		if(pool_ptr->messages_in_queue[current_actor] == 0 && 
+		   check_dead) {
+
+			pool_ptr->alive_actors--;
+		}
+
+		/* Process message */
+
+		if(acquired_message->message_type == MSG_GODIE) {
+
+			handle_godie_msg(current_actor);
+		}
+		else if(acquired_message->message_type == MSG_SPAWN) {
+
+			handle_spawn_msg(acquired_message);
+		}
+		else if(expired) {
+
+			handle_expired_msg(current_actor, acquired_message);
+		}
+		else if(batch_count > 0) {
+
+			handle_batch_msg(current_actor, batch_count);
+		}
+		else if(acquired_message->message_type >= 0 &&
+				(size_t) acquired_message->message_type < pool_ptr->actor_roles[current_actor]->nprompts) {
+
+			handle_other_msg(current_actor, acquired_message);
+		}
+		else {
+			perror("Critical: unknown message type - terminating...");
+			exit(1);
+		}
+
+		free(acquired_message);
+
+		/* Update working status and wake threads if there is need to */
+
+		worker_lock();
+		flush_outbox();
+		finish_turn(current_actor);
+		worker_unlock();
+	}
+
+#ifdef SINGLE_WORKER
+	mutex_lock(&pool_ptr->mutex);
+#endif
+
+	pool_ptr->working_count--;
+
+	free_spare_coroutines();
+
+#ifdef CACTI_PROFILE
+	profile_merge();
+#endif
+
+	if(pool_ptr->working_count > 0) {
+		cond_signal(&pool_ptr->await_cond);
+		mutex_unlock(&pool_ptr->mutex);
+	}
+	else {
+		cond_signal(&pool_ptr->finish_cond);
+		mutex_unlock(&pool_ptr->mutex);
+	}
+
+	return NULL;
+}
+
+/* Tells whether no handler runs and no message waits; in single worker
+ * mode, whether worker went to sleep and nothing was handed over to it
+ * since. Called with pool mutex held.
+ */
+static bool is_quiescent() {
+#ifdef SINGLE_WORKER
+	return pool->waiting_threads > 0 &&
+		   __atomic_load_n(&pool->handoff_head, __ATOMIC_SEQ_CST) == NULL;
+#else
+	return pool->active_handlers == 0 && pool->waiting_messages == 0;
+#endif
+}
+
+/* Makes workers exit once their current handlers return. Called with
+ * pool mutex held.
+ */
+static void stop_workers() {
+#ifdef SINGLE_WORKER
+	__atomic_store_n(&pool->shutdown, true, __ATOMIC_SEQ_CST);
+#else
+	pool->shutdown = true;
+#endif
+	cond_broadcast(&pool->await_cond);
+	cond_broadcast(&pool->quiesce_cond);
+}
+
+/* Waits for shutdown request recorded by signal handler, then lets queued
+ * messages be handled for at most drain budget and stops workers. Actor
+ * system is torn down right away unless actor_system_join does it.
+ */
+static void *shutdown_action(__attribute__((unused)) void *arg) {
+	char request;
+	ssize_t count;
+
+	while((count = read(pool->shutdown_pipe[0], &request, 1)) < 0 && errno == EINTR);
+
+	if(count != 1 || request == SHUTDOWN_QUIT) {
+		return NULL;
+	}
+
+	mutex_lock(&pool->mutex);
+
+	if(pool->drain_budget > 0) {
+		unsigned long long deadline = monotonic_now() + pool->drain_budget;
+
+		pool->quiesce_waiters++;
+
+		while(!pool->shutdown && !is_quiescent() && monotonic_now() < deadline) {
+			cond_timedwait(&pool->quiesce_cond, &pool->mutex, deadline);
+		}
+
+		pool->quiesce_waiters--;
+	}
+
+	stop_workers();
+
+	bool joined = pool->active_join;
+
+	mutex_unlock(&pool->mutex);
+
+	if(!joined) {
+		thread_pool_destroy();
+	}
+
+	return NULL;
+}
+
+static int run_queue_init(run_queue_t *queue, size_t size) {
+	if((queue->items = malloc(size * sizeof(size_t))) == NULL)
+		return memory_error;
+
+	queue->size = size;
+	queue->iter = 0;
+	queue->count = 0;
+
+	return success;
+}
+
+static int thread_pool_init(const actor_system_config_t *config) {
+	int err;
+
+	if(pool == NULL)
+		return null_pointer;
+
+	size_t capacity = (config != NULL && config->expected_actors > 0) ? config->expected_actors :
+																		DEFAULT_SIZE;
+
+	if(capacity > CAST_LIMIT)
+		capacity = CAST_LIMIT;
+
+	pool->mailbox_size = (config != NULL && config->mailbox_size > 0) ? config->mailbox_size :
+																		ACTOR_QUEUE_LIMIT;
+	pool->huge_pages = config != NULL ? config->huge_pages : HUGE_PAGES_NONE;
+	pool->drop_oldest = config != NULL && config->drop_oldest;
+	pool->drop_hook = config != NULL ? config->drop_hook : NULL;
+	pool->drain_budget = config != NULL ? config->shutdown_drain_ms * 1000000ull : 0;
+	pool->table.memory = NULL;
+	pool->mailbox_regions = 0;
+	pool->shutdown_pipe[0] = -1;
+	pool->shutdown_pipe[1] = -1;
+
+	pool->scheduler = config != NULL ? config->scheduler : SCHEDULE_FIFO;
+	pool->pops = 0;
+	pool->ngroups = 0;
+	pool->group_weights = NULL;
+	pool->group_queues = NULL;
+	pool->current_group = 0;
+	pool->group_credit = 0;
+
+	if(pool->scheduler == SCHEDULE_WEIGHTED) {
+		pool->ngroups = config->ngroups;
+
+		if((pool->group_weights = malloc(pool->ngroups * sizeof(size_t))) == NULL)
+			return memory_error;
+
+		if((pool->group_queues = malloc(pool->ngroups * sizeof(run_queue_t))) == NULL)
+			return memory_error;
+
+		for(size_t i = 0; i < pool->ngroups; ++i) {
+			pool->group_weights[i] = config->group_weights[i];
+
+			if(run_queue_init(&pool->group_queues[i], capacity) != success)
+				return memory_error;
+		}
+
+		pool->group_credit = pool->group_weights[0];
+	}
+
+	if(pthread_attr_init(&pool->attr))
+		return attr_init_error;
+
+	if((pool->threads = malloc(POOL_SIZE * sizeof(pthread_t))) == NULL)
+		return memory_error;
+
+	if((pool->served_actor = malloc(POOL_SIZE * sizeof(actor_id_t))) == NULL)
+		return memory_error;
+
+	if(run_queue_init(&pool->work_queue, capacity) != success)
+		return memory_error;
+
+	if(map_table() != success || add_actors(0, capacity) != success)
+		return memory_error;
+
+	for(size_t i = 0; i < POOL_SIZE; ++i) {
+		pool->served_actor[i] = 0;
+	}
+
+	for(size_t i = 0; i < SLAB_CLASSES; ++i) {
+		pool->slabs[i].chunks = NULL;
+		pool->slabs[i].free_list = NULL;
+	}
+
+	system_generation++;
+	__atomic_store_n(&expired_messages, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&evicted_messages, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&undelivered_messages, 0, __ATOMIC_RELAXED);
+
+	pool->arrays_size = capacity;
+	pool->pool_size = POOL_SIZE;
+	pool->actors_count = 0;
+	pool->waiting_messages = 0;
+	pool->waiting_threads = 0;
+	pool->actors_to_serve = 0;
+	pool->working_count = POOL_SIZE;
+	pool->active_handlers = 0;
+	pool->quiesce_waiters = 0;
+	pool->alive_actors = 0;
+	pool->shutdown = false;
+	pool->active_join = false;
+	pool->handoff_head = NULL;
+	pool->worker_sleeping = false;
+	pool->defer_wakeups = false;
+	pool->deferred_wakeups = 0;
+
+	if((err = pthread_mutex_init(&pool->mutex, NULL)) != 0)
+		return mutex_init_error;
+
+	if((err = pthread_cond_init(&pool->await_cond, NULL)) != 0)
+		return cond_init_error;
+
+	if((err = pthread_cond_init(&pool->finish_cond, NULL)) != 0)
+		return cond_init_error;
+
+	pthread_condattr_t quiesce_attr;
+
+	if(pthread_condattr_init(&quiesce_attr) != 0 ||
+	   pthread_condattr_setclock(&quiesce_attr, CLOCK_MONOTONIC) != 0 ||
+	   pthread_cond_init(&pool->quiesce_cond, &quiesce_attr) != 0)
+		return cond_init_error;
+
+	pthread_condattr_destroy(&quiesce_attr);
+
+	if(pipe(pool->shutdown_pipe) != 0)
+		return memory_error;
+
+	if(fcntl(pool->shutdown_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+		close_shutdown_pipe();
+		return memory_error;
+	}
+
+	struct sigaction action;
+	sigset_t block_mask;
+	sigemptyset(&block_mask);
+
+	action.sa_sigaction = catch;
+	action.sa_mask = block_mask;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+
+	if(sigaction(SIGINT, &action, NULL) != 0) {
+		perror("Initialising sigaction failed.");
+		exit(1);
+	}
+
+	if(pthread_create(&pool->watcher, &pool->attr, shutdown_action, NULL) != 0) {
+		close_shutdown_pipe();
+		return pthread_create_error;
+	}
+
+	shutdown_fd = pool->shutdown_pipe[1];
+
+	for(size_t i = 0; i < POOL_SIZE; i++) {
+		if((err = pthread_create(&pool->threads[i], &pool->attr, thread_action, (void *) pool)) != 0) {
+			thread_pool_destroy();
+			return pthread_create_error;
+		}
+	}
+
+	return success;
+}
+
+/************************************************************************************/
+/*																					*/
+/*																					*/
+/*									ACTORS SYSTEM 									*/
+/*																					*/
+/*																					*/
+/************************************************************************************/
+
+actor_id_t actor_id_self() {
+
+	return ACTOR_ID(local_node, pool->served_actor[map_thread_to_index()]);
+}
+
+unsigned long long message_deadline(unsigned long long ttl) {
+	return monotonic_now() + ttl;
+}
+
+void actor_system_stats(actor_system_stats_t *stats) {
+	if(stats == NULL)
+		return;
+
+	stats->expired = __atomic_load_n(&expired_messages, __ATOMIC_RELAXED);
+	stats->evicted = __atomic_load_n(&evicted_messages, __ATOMIC_RELAXED);
+	stats->undelivered = __atomic_load_n(&undelivered_messages, __ATOMIC_RELAXED);
+}
+
+void actor_system_join(actor_id_t actor) {
+
+	if(pool == NULL){
+		return;
+	}
+
+	mutex_lock(&pool->mutex);
+
+	if(ACTOR_NODE(actor) != local_node || (size_t) ACTOR_LOCAL(actor) >= pool->actors_count) {
+		mutex_unlock(&pool->mutex);
+		perror("Actor with specified id does not exist...");
+		return;
+	}
+
+	pool->active_join = true;
+
+	while(true) {
+
+		if(pool->working_count > 0) {
+
+			cond_wait(&pool->finish_cond, &pool->mutex);
+		}
+		else {
+
+			break;
+		}
+	}
+
+	/* active_join stays set, so that shutdown watcher leaves teardown to
+	 * this thread */
+
+#ifdef CACTI_PROFILE
+	profile_report();
+#endif
+
+	mutex_unlock(&pool->mutex);
+	thread_pool_destroy();
+}
+
+static int route_message(actor_id_t actor, message_t *message_copy);
+
+/* Drops oldest queued message of actor other than MSG_SPAWN, MSG_GODIE
+ * and MSG_HELLO, which greets new actor; when there is none, mailbox
+ * stays full. Caller holds pool lock.
+ */
+static void evict_oldest(size_t actor, message_t **mailbox) {
+	size_t first = pool->queue_iterators[actor];
+
+	for(size_t i = 0; i < pool->messages_in_queue[actor]; ++i) {
+		message_t *victim = mailbox[mailbox_wrap(first + i)];
+
+		if(victim->message_type == MSG_SPAWN || victim->message_type == MSG_GODIE ||
+		   victim->message_type == MSG_HELLO) {
+			continue;
+		}
+
+		/* Messages before victim move one slot on, keeping their order */
+		for(size_t j = i; j > 0; --j) {
+			mailbox[mailbox_wrap(first + j)] = mailbox[mailbox_wrap(first + j - 1)];
+		}
+
+		pool->queue_iterators[actor] = mailbox_wrap(first + 1);
+		pool->messages_in_queue[actor]--;
+		pool->waiting_messages--;
+
+		drop_message(actor, victim, &evicted_messages);
+		free(victim);
+
+		return;
+	}
+}
+
+/* Puts copy of message into mailbox of existing actor, which is not a
+ * router, and schedules actor if it was idle. Caller holds pool lock (or
+ * is the worker in single worker mode); message is freed on failure.
+ */
+static int push_resolved(size_t actor, message_t **mailbox, message_t *message_copy) {
+	if(pool->actor_status[actor] == dead) {
+		free(message_copy);
+		return -1;
+	}
+
+	bool resumable = pool->work_state[actor] == suspended &&
+					 pool->coroutines[actor]->resume == NULL && !pool->coroutines[actor]->cancelled;
+
+	if(resumable && pool->coroutines[actor]->awaited == message_copy->message_type) {
+
+		pool->coroutines[actor]->resume = message_copy;
+		pool->waiting_messages++;
+
+		append_to_queue(actor);
+		pool->actors_to_serve++;
+
+		wake_worker();
+
+		return 0;
+	}
+
+	if(pool->messages_in_queue[actor] == pool->mailbox_size && pool->drop_oldest) {
+		evict_oldest(actor, mailbox);
+	}
+
+	if(pool->messages_in_queue[actor] == pool->mailbox_size) {
+		free(message_copy);
+		return -3;
+	}
+
+	size_t iter = mailbox_wrap(pool->queue_iterators[actor] + pool->messages_in_queue[actor]);
+
+	mailbox[iter] = message_copy;
+	pool->messages_in_queue[actor]++;
+	pool->waiting_messages++;
+
+	if(pool->work_state[actor] == waiting && pool->messages_in_queue[actor] == 1) {
+
+		append_to_queue(actor);
+		pool->actors_to_serve++;
+
+		wake_worker();
+	}
+	else if(resumable && message_copy->message_type == MSG_GODIE) {
+		cancel_await(actor);
+	}
+
+	return 0;
+}
+
+/* Looks actor up and puts copy of message into its mailbox, or routes it
+ * when actor is a router. Same locking as push_resolved.
+ */
+static int push_message(actor_id_t actor, message_t *message_copy) {
+	if((size_t) actor >= pool->actors_count) {
+		free(message_copy);
+		return -2;
+	}
+
+	if(pool->routers[actor] != NULL) {
+		return route_message(actor, message_copy);
+	}
+
+	return push_resolved(actor, pool->message_queues[actor], message_copy);
+}
+
+#ifdef USE_OUTBOX
+
+/* Delivers messages buffered by this worker, grouped by destination with
+ * order of messages to the same actor kept, waking threads once. Called
+ * with pool lock held.
+ */
+static void flush_outbox() {
+	outbox_entry_t *entries = outbox.entries;
+	size_t count = outbox.count;
+
+	if(count == 0) {
+		return;
+	}
+
+	for(size_t i = 1; i < count; ++i) {
+		outbox_entry_t entry = entries[i];
+		size_t j = i;
+
+		while(j > 0 && entries[j - 1].actor > entry.actor) {
+			entries[j] = entries[j - 1];
+			j--;
+		}
+
+		entries[j] = entry;
+	}
+
+	pool->defer_wakeups = true;
+	pool->deferred_wakeups = 0;
+
+	for(size_t i = 0; i < count; ++i) {
+		if(pool->shutdown) {
+			drop_message(entries[i].actor, entries[i].message, NULL);
+			free(entries[i].message);
+		}
+		else {
+			/* Sender was already told message is sent, so failure is
+			 * reported through drop hook only */
+			message_t message = *entries[i].message;
+			int err = (entries[i].mailbox != NULL) ?
+					  push_resolved(entries[i].actor, entries[i].mailbox, entries[i].message) :
+					  push_message(entries[i].actor, entries[i].message);
+
+			if(err < 0) {
+				drop_message(entries[i].actor, &message, &undelivered_messages);
+			}
+		}
+	}
+
+	pool->defer_wakeups = false;
+	outbox.count = 0;
+
+	if(pool->deferred_wakeups > 1 && pool->waiting_threads > 1) {
+		cond_broadcast(&pool->await_cond);
+	}
+	else if(pool->deferred_wakeups > 0 && pool->waiting_threads > 0) {
+		cond_signal(&pool->await_cond);
+	}
+}
+
+/* Buffers message sent by handler, to mailbox when it is already known.
+ * Only missing actor is reported to sender; messages found undeliverable
+ * on flush are passed to drop hook.
+ */
+static int outbox_push(actor_id_t actor, message_t **mailbox, message_t message) {
+	/* Actors are never removed, so id below count stays valid */
+	if((size_t) actor >= __atomic_load_n(&pool->actors_count, __ATOMIC_RELAXED))
+		return -2;
+
+	message_t *message_copy = malloc(sizeof(message_t));
+
+	if(message_copy == NULL)
+		return -1;
+
+	*message_copy = message;
+
+	outbox.entries[outbox.count].actor = actor;
+	outbox.entries[outbox.count].mailbox = mailbox;
+	outbox.entries[outbox.count].message = message_copy;
+	outbox.count++;
+
+	if(outbox.count == OUTBOX_LIMIT) {
+		mutex_lock(&pool->mutex);
+		flush_outbox();
+		mutex_unlock(&pool->mutex);
+	}
+
+	return 0;
+}
+
+#else
+
+static void flush_outbox() {
+}
+
+#endif
+
+#ifdef SINGLE_WORKER
+
+/* Moves messages sent from other threads into mailboxes, in order they
+ * were sent. Messages to missing, dead or full actors are passed to drop
+ * hook and counted as undelivered.
+ */
+static void drain_handoff() {
+	if(__atomic_load_n(&pool->handoff_head, __ATOMIC_ACQUIRE) == NULL) {
+		return;
+	}
+
+	handoff_t *node = __atomic_exchange_n(&pool->handoff_head, NULL, __ATOMIC_ACQ_REL);
+	handoff_t *ordered = NULL;
+
+	while(node != NULL) {
+		handoff_t *next = node->next;
+		node->next = ordered;
+		ordered = node;
+		node = next;
+	}
+
+	while(ordered != NULL) {
+		handoff_t *next = ordered->next;
+		message_t message = ordered->message;
+
+		/* Node is freed together with message on failure */
+		if(push_message(ordered->actor, &ordered->message) < 0) {
+			drop_message(ordered->actor, &message, &undelivered_messages);
+		}
+
+		ordered = next;
+	}
+}
+
+/* Blocks worker until message is handed over or shutdown is requested */
+static void worker_sleep() {
+	mutex_lock(&pool->mutex);
+
+	__atomic_store_n(&pool->worker_sleeping, true, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&pool->handoff_head, __ATOMIC_SEQ_CST) == NULL &&
+	   !__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST)) {
+
+		pool->waiting_threads++;
+
+		if(pool->quiesce_waiters > 0) {
+			cond_broadcast(&pool->quiesce_cond);
+		}
+
+		cond_wait(&pool->await_cond, &pool->mutex);
+		pool->waiting_threads--;
+	}
+
+	__atomic_store_n(&pool->worker_sleeping, false, __ATOMIC_SEQ_CST);
+
+	mutex_unlock(&pool->mutex);
+}
+
+static void handoff_push(handoff_t *node) {
+	node->next = __atomic_load_n(&pool->handoff_head, __ATOMIC_RELAXED);
+
+	while(!__atomic_compare_exchange_n(&pool->handoff_head, &node->next, node, true,
+									   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	if(__atomic_load_n(&pool->worker_sleeping, __ATOMIC_SEQ_CST)) {
+		mutex_lock(&pool->mutex);
+		cond_signal(&pool->await_cond);
+		mutex_unlock(&pool->mutex);
+	}
+}
+
+static int handoff_message(actor_id_t actor, message_t message) {
+	if(__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST))
+		return -1;
+
+	handoff_t *node = malloc(sizeof(handoff_t));
+
+	if(node == NULL)
+		return -1;
+
+	node->message = message;
+	node->actor = actor;
+
+	handoff_push(node);
+
+	return 0;
+}
+
+#endif
+
+static int remote_send(actor_id_t actor, message_t message);
+
+/* Sends message to local actor, through mailbox when caller resolved it */
+static int send_local(size_t actor, message_t **mailbox, message_t message) {
+#ifdef USE_OUTBOX
+	if(outbox.active)
+		return outbox_push(actor, mailbox, message);
+#endif
+
+#ifdef SINGLE_WORKER
+	if(!pthread_equal(pthread_self(), pool->threads[0])) {
+		return handoff_message(actor, message);
+	}
+#endif
+
+	worker_lock();
+
+	if(pool->shutdown) {
+		worker_unlock();
+		return -1;
+	}
+
+	message_t *message_copy = malloc(sizeof(message_t));
+
+	if(message_copy == NULL) {
+		worker_unlock();
+		return -1;
+	}
+
+	message_copy->message_type = message.message_type;
+	message_copy->nbytes = message.nbytes;
+	message_copy->data = message.data;
+	message_copy->deadline = message.deadline;
+
+	int err = (mailbox != NULL) ? push_resolved(actor, mailbox, message_copy) :
+								  push_message(actor, message_copy);
+
+	worker_unlock();
+
+	return err;
+}
+
+int send_message(actor_id_t actor, message_t message) {
+	if(pool == NULL)
+		return -1;
+
+	if(ACTOR_NODE(actor) != local_node)
+		return remote_send(actor, message);
+
+	return send_local(ACTOR_LOCAL(actor), NULL, message);
+}
+
+int actor_ref_resolve(actor_ref_t *ref, actor_id_t actor) {
+	if(pool == NULL || ref == NULL)
+		return -1;
+
+	ref->actor = actor;
+	ref->generation = system_generation;
+	ref->mailbox = NULL;
+
+	if(ACTOR_NODE(actor) != local_node)
+		return 0;
+
+#ifdef SINGLE_WORKER
+	/* Only worker may look at actor table, others keep sending by id */
+	if(!pthread_equal(pthread_self(), pool->threads[0]))
+		return 0;
+#endif
+
+	size_t local = ACTOR_LOCAL(actor);
+	int err = 0;
+
+	worker_lock();
+
+	if(local >= pool->actors_count) {
+		err = -2;
+	}
+	else if(pool->actor_status[local] == dead) {
+		err = -1;
+	}
+	else if(pool->routers[local] == NULL) {
+		/* Mailbox of actor is never moved while actor system lives */
+		ref->mailbox = pool->message_queues[local];
+	}
+
+	worker_unlock();
+
+	return err;
+}
+
+int send_message_ref(const actor_ref_t *ref, message_t message) {
+	if(pool == NULL || ref == NULL || ref->generation != system_generation)
+		return -1;
+
+	if(ref->mailbox == NULL)
+		return send_message(ref->actor, message);
+
+	return send_local(ACTOR_LOCAL(ref->actor), ref->mailbox, message);
 }
 
 int actor_system_create(actor_id_t *actor, role_t *const role) {
+
+	return actor_system_create_config(actor, role, NULL);
+}
+
+static int check_config(const actor_system_config_t *config) {
+
+	if(config != NULL && (config->scheduler > SCHEDULE_WEIGHTED ||
+						  config->huge_pages > HUGE_PAGES_EXPLICIT))
+		return -1;
+
+	if(config != NULL && config->scheduler == SCHEDULE_WEIGHTED) {
+		if(config->ngroups == 0 || config->group_weights == NULL)
+			return -1;
+
+		for(size_t i = 0; i < config->ngroups; ++i)
+			if(config->group_weights[i] == 0)
+				return -1;
+	}
+
+	return 0;
+}
+
+int actor_system_create_config(actor_id_t *actor, role_t *const role,
+							   const actor_system_config_t *config) {
+
+	if(check_config(config) != 0)
+		return -1;
+
 	pool = malloc(sizeof(thread_pool_t));
 
-	if(pool == NULL)
+	if(pool == NULL)
+		return -1;
+
+	if(thread_pool_init(config) != 0 || transport_start() != 0)
+		return -1;
+
+	*actor = ACTOR_ID(local_node, 0);
+
+	pool->actor_status[0] = alive;
+	pool->actor_roles[0] = role;
+	allocate_state(0);
+	pool->work_state[0] = waiting;
+	pool->messages_in_queue[0] = 0;
+	pool->actors_count = 1;
+	pool->alive_actors = 1;
+
+	send_message(*actor, (message_t) { .message_type = MSG_HELLO,
+									   .nbytes = 0,
+									   .data = NULL });
+
+	return 0;
+}
+
+
+/************************************************************************************/
+/*																					*/
+/*																					*/
+/*									ROUTERS 										*/
+/*																					*/
+/*																					*/
+/************************************************************************************/
+
+static uint64_t hash_bytes(const void *data, size_t nbytes) {
+	const unsigned char *bytes = (const unsigned char *) data;
+	uint64_t hash = 14695981039346656037ull;
+
+	for(size_t i = 0; i < nbytes; ++i) {
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+
+	return hash;
+}
+
+/* Jump consistent hash: adding targets moves only keys that go to them */
+static size_t jump_hash(uint64_t key, size_t buckets) {
+	long long bucket = -1, jump = 0;
+
+	while(jump < (long long) buckets) {
+		bucket = jump;
+		key = key * 2862933555777941757ull + 1;
+		jump = (long long) ((bucket + 1) * ((double) (1ll << 31) / (double) ((key >> 33) + 1)));
+	}
+
+	return (size_t) bucket;
+}
+
+static bool target_alive(router_t *router, size_t index) {
+	return pool->actor_status[router->targets[index]] != dead;
+}
+
+/* Index of first target alive at or after start, wrapping around, or
+ * ntargets when all are dead */
+static size_t next_alive(router_t *router, size_t start) {
+	for(size_t i = 0; i < router->ntargets; ++i) {
+		size_t index = (start + i) % router->ntargets;
+
+		if(target_alive(router, index)) {
+			return index;
+		}
+	}
+
+	return router->ntargets;
+}
+
+static size_t random_target(router_t *router) {
+	router->seed ^= router->seed << 13;
+	router->seed ^= router->seed >> 7;
+	router->seed ^= router->seed << 17;
+
+	return (size_t) (router->seed % router->ntargets);
+}
+
+/* Picks alive target for message, dead targets are skipped; returns
+ * ntargets when there is none. Called with pool lock held.
+ */
+static size_t pick_target(router_t *router, message_t *message) {
+	switch(router->policy) {
+		case ROUTE_ROUND_ROBIN: {
+			size_t index = next_alive(router, router->next);
+
+			if(index < router->ntargets) {
+				router->next = (index + 1) % router->ntargets;
+			}
+
+			return index;
+		}
+		case ROUTE_RANDOM: {
+			/* Probes keep choice uniform among alive targets, scan only
+			 * settles rare runs of misses */
+			for(size_t i = 0; i < router->ntargets; ++i) {
+				size_t index = random_target(router);
+
+				if(target_alive(router, index)) {
+					return index;
+				}
+			}
+
+			return next_alive(router, random_target(router));
+		}
+		case ROUTE_HASH: {
+			uint64_t key = message->nbytes > 0 ?
+						   hash_bytes(message->data, message->nbytes) :
+						   hash_bytes(&message->data, sizeof(void *));
+
+			/* Keys of dead target are rehashed, so that keys of alive
+			 * targets stay where they were */
+			for(size_t i = 0; i < router->ntargets; ++i) {
+				size_t index = jump_hash(key, router->ntargets);
+
+				if(target_alive(router, index)) {
+					return index;
+				}
+
+				key = hash_bytes(&key, sizeof(key));
+			}
+
+			return next_alive(router, jump_hash(key, router->ntargets));
+		}
+		case ROUTE_LEAST_LOADED:
+		default: {
+			size_t best = router->ntargets, best_load = (size_t) -1;
+
+			for(size_t i = 0; i < router->ntargets; ++i) {
+				actor_id_t target = router->targets[i];
+
+				if(!target_alive(router, i)) {
+					continue;
+				}
+
+				size_t load = pool->messages_in_queue[target] +
+							  (pool->work_state[target] == working ? 1 : 0);
+
+				if(load < best_load) {
+					best = i;
+					best_load = load;
+				}
+			}
+
+			return best;
+		}
+	}
+}
+
+/* Forwards message addressed to router into mailbox of chosen target.
+ * Called with pool lock held, like push_message.
+ */
+static int route_message(actor_id_t actor, message_t *message_copy) {
+	router_t *router = pool->routers[actor];
+
+	if(pool->actor_status[actor] == dead) {
+		free(message_copy);
+		return -1;
+	}
+
+	if(message_copy->message_type == MSG_GODIE) {
+		pool->actor_status[actor] = dead;
+		free(message_copy);
+		return 0;
+	}
+
+	size_t index = pick_target(router, message_copy);
+
+	if(index == router->ntargets) {
+		free(message_copy);
+		return -1;
+	}
+
+	return push_message(router->targets[index], message_copy);
+}
+
+/* Registers router over local targets. In single worker mode it has to be
+ * called from within handler.
+ */
+int router_create(actor_id_t *router, router_policy_t policy,
+				  const actor_id_t *targets, size_t ntargets) {
+	if(pool == NULL || router == NULL || targets == NULL || ntargets == 0)
+		return -1;
+
+	if(policy > ROUTE_LEAST_LOADED)
+		return -1;
+
+#ifdef SINGLE_WORKER
+	if(!pthread_equal(pthread_self(), pool->threads[0]))
+		return -1;
+#endif
+
+	router_t *created = malloc(sizeof(router_t) + ntargets * sizeof(actor_id_t));
+
+	if(created == NULL)
+		return -1;
+
+	created->policy = policy;
+	created->next = 0;
+	created->seed = 0x9e3779b97f4a7c15ull ^ (unsigned long long) (uintptr_t) created;
+	created->ntargets = ntargets;
+
+	worker_lock();
+
+	for(size_t i = 0; i < ntargets; ++i) {
+		if(ACTOR_NODE(targets[i]) != local_node ||
+		   (size_t) ACTOR_LOCAL(targets[i]) >= pool->actors_count) {
+
+			worker_unlock();
+			free(created);
+			return -2;
+		}
+
+		created->targets[i] = ACTOR_LOCAL(targets[i]);
+	}
+
+	if(pool->shutdown || pool->actors_count == CAST_LIMIT) {
+		worker_unlock();
+		free(created);
+		return -1;
+	}
+
+	if(pool->actors_count == pool->arrays_size) {
+		grow_arrays();
+	}
+
+	size_t router_id = __atomic_fetch_add(&pool->actors_count, 1, __ATOMIC_RELAXED);
+
+	pool->actor_status[router_id] = alive;
+	pool->actor_roles[router_id] = NULL;
+	pool->actor_state_ptr[router_id] = NULL;
+	pool->work_state[router_id] = waiting;
+	pool->routers[router_id] = created;
+
+	worker_unlock();
+
+	*router = ACTOR_ID(local_node, router_id);
+
+	return 0;
+}
+
+/************************************************************************************/
+/*																					*/
+/*																					*/
+/*									SNAPSHOTS 										*/
+/*																					*/
+/*																					*/
+/************************************************************************************/
+
+#define SNAPSHOT_MAGIC 0x63616374u
+#define SNAPSHOT_VERSION 1u
+#define SNAPSHOT_ALIGN 16
+#define NO_ROLE ((size_t) -1)
+
+/* Layout of snapshot file: header, one record per actor, then state blobs
+ * placed at offsets stored in records (relative to beginning of file).
+ */
+typedef struct snapshot_header {
+	unsigned magic;
+	unsigned version;
+	size_t actors_count;
+	size_t nroles;
+	size_t total_size;
+} snapshot_header_t;
+
+typedef struct snapshot_record {
+	size_t status;
+	size_t role_index;
+	size_t state_offset;
+	size_t state_size;
+} snapshot_record_t;
+
+static size_t align_size(size_t size) {
+	return (size + SNAPSHOT_ALIGN - 1) & ~((size_t) SNAPSHOT_ALIGN - 1);
+}
+
+static size_t find_role(role_t *role, role_t *const *roles, size_t nroles) {
+	for(size_t i = 0; i < nroles; ++i) {
+		if(roles[i] == role) {
+			return i;
+		}
+	}
+
+	return NO_ROLE;
+}
+
+static bool is_pool_thread() {
+	for(size_t i = 0; i < POOL_SIZE; ++i) {
+		if(pthread_equal(pthread_self(), pool->threads[i])) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Waits until no handler is running and no message is queued, then writes
+ * actor table with serialized states to file at path. Roles of all actors
+ * have to be present in roles array, since role pointers are stored as
+ * indices into it. Handler suspended in actor_await counts as idle, but
+ * its stack can not be saved, so snapshot fails then. Must not be called
+ * from within handler.
+ */
+int actor_system_snapshot(const char *path, role_t *const *roles, size_t nroles) {
+	if(pool == NULL || path == NULL || (roles == NULL && nroles > 0))
+		return -1;
+
+	if(is_pool_thread())
+		return -1;
+
+	mutex_lock(&pool->mutex);
+
+	pool->quiesce_waiters++;
+
+	while(!pool->shutdown && !is_quiescent()) {
+		cond_wait(&pool->quiesce_cond, &pool->mutex);
+	}
+
+	pool->quiesce_waiters--;
+
+	if(pool->shutdown) {
+		mutex_unlock(&pool->mutex);
 		return -1;
+	}
+
+	size_t count = pool->actors_count;
+	size_t total = align_size(sizeof(snapshot_header_t) + count * sizeof(snapshot_record_t));
+
+	for(size_t i = 0; i < count; ++i) {
+		if(pool->coroutines[i] != NULL) {
+			mutex_unlock(&pool->mutex);
+			return -1;
+		}
+	}
+
+	for(size_t i = 0; i < count; ++i) {
+		role_t *role = pool->actor_roles[i];
+
+		if(pool->routers[i] != NULL) {
+			continue;
+		}
 
-	if(thread_pool_init() != 0)
+		if(find_role(role, roles, nroles) == NO_ROLE) {
+			mutex_unlock(&pool->mutex);
+			return -2;
+		}
+
+		if(pool->actor_status[i] == alive && role->state_size > 0) {
+			total += align_size(role->state_size);
+		}
+		else if(pool->actor_status[i] == alive && role->serialize != NULL) {
+			total += align_size(role->serialize(pool->actor_state_ptr[i], NULL, 0));
+		}
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if(fd < 0 || ftruncate(fd, (off_t) total) != 0) {
+		if(fd >= 0)
+			close(fd);
+		mutex_unlock(&pool->mutex);
 		return -1;
+	}
 
-	*actor = 0;
+	char *base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-	pool->actor_status[0] = alive;
-	pool->actor_roles[0] = role;
-	pool->actor_state_ptr[0] = NULL;
-	pool->work_state[0] = waiting;
-	pool->messages_in_queue[0] = 0;
-	pool->actors_count = 1;
-	pool->alive_actors = 1;
+	if(base == MAP_FAILED) {
+		close(fd);
+		mutex_unlock(&pool->mutex);
+		return -1;
+	}
+
+	snapshot_header_t *header = (snapshot_header_t *) base;
+	snapshot_record_t *records = (snapshot_record_t *) (base + sizeof(snapshot_header_t));
+	size_t offset = align_size(sizeof(snapshot_header_t) + count * sizeof(snapshot_record_t));
+
+	header->magic = SNAPSHOT_MAGIC;
+	header->version = SNAPSHOT_VERSION;
+	header->actors_count = count;
+	header->nroles = nroles;
+	header->total_size = total;
+
+	for(size_t i = 0; i < count; ++i) {
+		role_t *role = pool->actor_roles[i];
+
+		records[i].status = pool->actor_status[i];
+		records[i].role_index = find_role(role, roles, nroles);
+		records[i].state_offset = offset;
+		records[i].state_size = 0;
+
+		/* Routers are not restored, their slots stay dead */
+		if(pool->routers[i] != NULL) {
+			records[i].status = dead;
+			records[i].role_index = NO_ROLE;
+			continue;
+		}
+
+		if(pool->actor_status[i] == alive && role->state_size > 0) {
+			memcpy(base + offset, pool->actor_state_ptr[i], role->state_size);
+
+			records[i].state_size = role->state_size;
+			offset += align_size(role->state_size);
+		}
+		else if(pool->actor_status[i] == alive && role->serialize != NULL) {
+			size_t size = role->serialize(pool->actor_state_ptr[i], base + offset, total - offset);
+
+			records[i].state_size = size;
+			offset += align_size(size);
+		}
+	}
+
+	mutex_unlock(&pool->mutex);
+
+	int err = msync(base, total, MS_SYNC);
+
+	munmap(base, total);
+	close(fd);
+
+	return err == 0 ? 0 : -1;
+}
+
+/* Creates actor system from snapshot written by actor_system_snapshot.
+ * All actors are recreated at once with deserialized states, no MSG_HELLO
+ * is delivered. Roles array must list roles in the same order as during
+ * snapshot.
+ */
+int actor_system_restore(actor_id_t *actor, const char *path,
+						 role_t *const *roles, size_t nroles) {
+
+	return actor_system_restore_config(actor, path, roles, nroles, NULL);
+}
+
+int actor_system_restore_config(actor_id_t *actor, const char *path,
+								role_t *const *roles, size_t nroles,
+								const actor_system_config_t *config) {
+	if(actor == NULL || path == NULL || pool != NULL || check_config(config) != 0)
+		return -1;
+
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0)
+		return -1;
+
+	struct stat info;
+
+	if(fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(snapshot_header_t)) {
+		close(fd);
+		return -1;
+	}
+
+	size_t total = (size_t) info.st_size;
+	char *base = mmap(NULL, total, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if(base == MAP_FAILED)
+		return -1;
+
+	snapshot_header_t *header = (snapshot_header_t *) base;
+	snapshot_record_t *records = (snapshot_record_t *) (base + sizeof(snapshot_header_t));
+
+	if(header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+	   header->total_size != total || header->nroles != nroles ||
+	   header->actors_count == 0 || header->actors_count > CAST_LIMIT ||
+	   sizeof(snapshot_header_t) + header->actors_count * sizeof(snapshot_record_t) > total) {
+
+		munmap(base, total);
+		return -1;
+	}
+
+	for(size_t i = 0; i < header->actors_count; ++i) {
+		if((records[i].status != alive && records[i].status != dead) ||
+		   (records[i].role_index >= nroles &&
+			(records[i].role_index != NO_ROLE || records[i].status == alive)) ||
+		   records[i].state_offset > total ||
+		   records[i].state_size > total - records[i].state_offset ||
+		   (records[i].status == alive && roles[records[i].role_index]->state_size > 0 &&
+			records[i].state_size != roles[records[i].role_index]->state_size)) {
+
+			munmap(base, total);
+			return -1;
+		}
+	}
+
+	if((pool = malloc(sizeof(thread_pool_t))) == NULL) {
+		munmap(base, total);
+		return -1;
+	}
+
+	/* Table is set up for all restored actors at once, so that lack of
+	 * memory is reported instead of terminating in grow_arrays */
+	actor_system_config_t restore_config = config != NULL ? *config : (actor_system_config_t) { 0 };
+
+	if(restore_config.expected_actors < header->actors_count)
+		restore_config.expected_actors = header->actors_count;
+
+	if(thread_pool_init(&restore_config) != 0 || transport_start() != 0) {
+		munmap(base, total);
+		return -1;
+	}
+
+	mutex_lock(&pool->mutex);
+
+	for(size_t i = 0; i < header->actors_count; ++i) {
+		role_t *role = records[i].role_index == NO_ROLE ? NULL : roles[records[i].role_index];
+
+		pool->actor_status[i] = records[i].status;
+		pool->actor_roles[i] = role;
+		pool->work_state[i] = waiting;
+		pool->actor_state_ptr[i] = NULL;
+
+		if(records[i].status == alive) {
+			pool->alive_actors++;
+
+			if(role->state_size > 0) {
+				void *state = slab_alloc(role->state_size);
+
+				if(state == NULL) {
+					perror("Critical: malloc");
+					exit(1);
+				}
+
+				memcpy(state, base + records[i].state_offset, role->state_size);
+				pool->actor_state_ptr[i] = state;
+			}
+			else if(role->deserialize != NULL && records[i].state_size > 0) {
+				pool->actor_state_ptr[i] = role->deserialize(base + records[i].state_offset,
+															 records[i].state_size);
+			}
+		}
+	}
+
+	pool->actors_count = header->actors_count;
+	mutex_unlock(&pool->mutex);
+
+	munmap(base, total);
+
+	*actor = ACTOR_ID(local_node, 0);
+
+	return 0;
+}
+
+
+/************************************************************************************/
+/*																					*/
+/*																					*/
+/*								SHARED MEMORY TRANSPORT 							*/
+/*																					*/
+/*																					*/
+/************************************************************************************/
+
+#define SEGMENT_MAGIC 0x63736d67u
+
+#if (SHM_RING_SIZE & (SHM_RING_SIZE - 1)) != 0
+#error "SHM_RING_SIZE has to be a power of two"
+#endif
+
+/* Slot of bounded multi-producer ring; sequence tells whether slot is
+ * free for position (== pos) or holds message of position (== pos + 1).
+ */
+typedef struct shm_slot {
+	size_t sequence;
+	actor_id_t target;
+	message_type_t message_type;
+	size_t nbytes;
+	void *value;
+	unsigned long long deadline;
+	char payload[SHM_PAYLOAD_LIMIT];
+} shm_slot_t;
+
+/* Inbound ring of one node, consumed by pump thread of that node */
+typedef struct shm_ring {
+	size_t enqueue_pos __attribute__((aligned(64)));
+	size_t dequeue_pos __attribute__((aligned(64)));
+	sem_t items;
+	shm_slot_t slots[SHM_RING_SIZE];
+} shm_ring_t;
+
+/* Header is written by creator before ready is set; other processes
+ * check it matches their layout */
+typedef struct shm_segment {
+	unsigned magic;
+	unsigned ready;
+	size_t nodes;
+	size_t size;
+	size_t attached;
+	shm_ring_t rings[];
+} shm_segment_t;
+
+typedef struct transport {
+	shm_segment_t *segment;
+	size_t segment_size;
+	size_t nodes;
+	char name[256];
+
+	pthread_t pump;
+	bool pump_running;
+	bool pump_stop;
+} transport_t;
+
+static transport_t transport = { .segment = NULL };
+
+static int ring_push(shm_ring_t *ring, actor_id_t target, message_t message) {
+	size_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	shm_slot_t *slot;
+
+	while(true) {
+		slot = &ring->slots[pos & (SHM_RING_SIZE - 1)];
+
+		size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		long diff = (long) (sequence - pos);
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, true,
+										   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if(diff < 0) {
+			return -3;
+		}
+		else {
+			pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->target = target;
+	slot->message_type = message.message_type;
+	slot->nbytes = message.nbytes;
+	slot->value = message.data;
+	slot->deadline = message.deadline;
+
+	if(message.nbytes > 0) {
+		memcpy(slot->payload, message.data, message.nbytes);
+	}
 
-	send_message(0, (message_t) { .message_type = MSG_HELLO,
-								  .nbytes = 0,
-								  .data = NULL });
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	if(sem_post(&ring->items) != 0) {
+		perror("Error: sem_post");
+		exit(1);
+	}
+
+	return 0;
+}
+
+static int remote_send(actor_id_t actor, message_t message) {
+	size_t node = ACTOR_NODE(actor);
+
+	if(transport.segment == NULL || node >= transport.nodes)
+		return -2;
+
+	if(message.message_type == MSG_SPAWN || message.nbytes > SHM_PAYLOAD_LIMIT)
+		return -1;
+
+	return ring_push(&transport.segment->rings[node], ACTOR_LOCAL(actor), message);
+}
+
+/* Hands message received from other node to local actor; payload is
+ * placed right after message so that it is freed together with it.
+ */
+static void deliver_remote(shm_slot_t *slot) {
+	size_t nbytes = slot->nbytes;
+
+#ifdef SINGLE_WORKER
+	handoff_t *node = malloc(sizeof(handoff_t) + nbytes);
+	message_t *message_copy = node != NULL ? &node->message : NULL;
+	char *payload = (char *) (node + 1);
+#else
+	message_t *message_copy = malloc(sizeof(message_t) + nbytes);
+	char *payload = (char *) (message_copy + 1);
+#endif
+
+	if(message_copy == NULL) {
+		perror("Critical: malloc");
+		exit(1);
+	}
+
+	message_copy->message_type = slot->message_type;
+	message_copy->nbytes = nbytes;
+	message_copy->data = slot->value;
+	message_copy->deadline = slot->deadline;
+
+	if(nbytes > 0) {
+		memcpy(payload, slot->payload, nbytes);
+		message_copy->data = payload;
+	}
+
+#ifdef SINGLE_WORKER
+	node->actor = slot->target;
+	handoff_push(node);
+#else
+	mutex_lock(&pool->mutex);
+
+	if(pool->shutdown) {
+		free(message_copy);
+	}
+	else {
+		push_message(slot->target, message_copy);
+	}
+
+	mutex_unlock(&pool->mutex);
+#endif
+}
+
+static unsigned long long shm_deadline() {
+	return monotonic_now() + SHM_WAIT_MS * 1000000ull;
+}
+
+/* Waits until producer that claimed slot of position publishes it;
+ * false when it did not in SHM_WAIT_MS, as process died meanwhile */
+static bool wait_published(shm_slot_t *slot, size_t pos) {
+	unsigned long long deadline = 0;
+
+	while(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+		if(deadline == 0) {
+			deadline = shm_deadline();
+		}
+		else if(monotonic_now() >= deadline) {
+			return false;
+		}
+
+		sched_yield();
+	}
+
+	return true;
+}
+
+static void *pump_action(__attribute__((unused)) void *arg) {
+	shm_ring_t *ring = &transport.segment->rings[local_node];
+
+	/* Set when post taken belongs to slot after skipped one */
+	bool posted = false;
+
+	while(true) {
+		if(!posted && sem_wait(&ring->items) != 0) {
+			continue;
+		}
+
+		posted = false;
+
+		if(__atomic_load_n(&transport.pump_stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		size_t pos = ring->dequeue_pos;
+		shm_slot_t *slot = &ring->slots[pos & (SHM_RING_SIZE - 1)];
+
+		/* Producer may have claimed slot but not published it yet */
+		if(wait_published(slot, pos)) {
+			deliver_remote(slot);
+		}
+		else {
+			posted = true;
+		}
+
+		__atomic_store_n(&slot->sequence, pos + SHM_RING_SIZE, __ATOMIC_RELEASE);
+		ring->dequeue_pos = pos + 1;
+	}
+
+	return NULL;
+}
+
+static int transport_start() {
+	if(transport.segment == NULL)
+		return 0;
+
+	transport.pump_stop = false;
+
+	if(pthread_create(&transport.pump, NULL, pump_action, NULL) != 0)
+		return -1;
+
+	transport.pump_running = true;
+
+	return 0;
+}
+
+static void transport_stop() {
+	if(!transport.pump_running)
+		return;
+
+	__atomic_store_n(&transport.pump_stop, true, __ATOMIC_RELEASE);
+
+	if(sem_post(&transport.segment->rings[local_node].items) != 0) {
+		perror("Error: sem_post");
+		exit(1);
+	}
+
+	pthread_join(transport.pump, NULL);
+	transport.pump_running = false;
+}
+
+int actor_system_attach(const char *name, size_t node, size_t nodes) {
+	if(name == NULL || node >= nodes || transport.segment != NULL || pool != NULL)
+		return -1;
+
+	if(strlen(name) >= sizeof(transport.name))
+		return -1;
+
+	size_t size = sizeof(shm_segment_t) + nodes * sizeof(shm_ring_t);
+	bool creator = true;
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+	if(fd < 0) {
+		creator = false;
+		fd = shm_open(name, O_RDWR, 0600);
+	}
+
+	if(fd < 0)
+		return -1;
+
+	if(creator && ftruncate(fd, (off_t) size) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+
+	/* Wait until creator sets size of segment, which differs when it was
+	 * given other number of nodes */
+	struct stat info;
+	unsigned long long deadline = shm_deadline();
+
+	int err;
+
+	while((err = fstat(fd, &info)) == 0 && info.st_size == 0 && monotonic_now() < deadline) {
+		sched_yield();
+	}
+
+	if(err != 0 || (size_t) info.st_size != size) {
+		close(fd);
+		return -1;
+	}
+
+	shm_segment_t *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if(segment == MAP_FAILED)
+		return -1;
+
+	if(creator) {
+		segment->magic = SEGMENT_MAGIC;
+		segment->nodes = nodes;
+		segment->size = size;
+		segment->attached = 0;
+
+		for(size_t i = 0; i < nodes; ++i) {
+			shm_ring_t *ring = &segment->rings[i];
+
+			ring->enqueue_pos = 0;
+			ring->dequeue_pos = 0;
+
+			if(sem_init(&ring->items, 1, 0) != 0) {
+				munmap(segment, size);
+				shm_unlink(name);
+				return -1;
+			}
+
+			for(size_t j = 0; j < SHM_RING_SIZE; ++j) {
+				ring->slots[j].sequence = j;
+			}
+		}
+
+		__atomic_store_n(&segment->ready, 1, __ATOMIC_RELEASE);
+	}
+	else {
+		while(__atomic_load_n(&segment->ready, __ATOMIC_ACQUIRE) == 0 && monotonic_now() < deadline) {
+			sched_yield();
+		}
+
+		if(__atomic_load_n(&segment->ready, __ATOMIC_ACQUIRE) == 0 || segment->magic != SEGMENT_MAGIC ||
+		   segment->nodes != nodes || segment->size != size) {
+			munmap(segment, size);
+			return -1;
+		}
+	}
+
+	__atomic_add_fetch(&segment->attached, 1, __ATOMIC_ACQ_REL);
+
+	transport.segment = segment;
+	transport.segment_size = size;
+	transport.nodes = nodes;
+	strcpy(transport.name, name);
+
+	local_node = node;
 
 	return 0;
 }
+
+/* Leaves segment; last process to leave removes it. Has to be called
+ * after actor system of this process is joined.
+ */
+void actor_system_detach() {
+	if(transport.segment == NULL || pool != NULL)
+		return;
+
+	if(__atomic_sub_fetch(&transport.segment->attached, 1, __ATOMIC_ACQ_REL) == 0) {
+		shm_unlink(transport.name);
+	}
+
+	munmap(transport.segment, transport.segment_size);
+
+	transport.segment = NULL;
+	local_node = 0;
+}
@@ -21,29 +21,255 @@ typedef long message_type_t;
 #define POOL_SIZE 3
 #endif
 
+/* Building with -DCACTI_PROFILE measures every handler call with hardware
+ * counters (or clock alone, when perf events are not permitted) and
+ * prints table per role and message type at actor_system_join. */
+
+/* Number of messages sent from handlers that worker buffers before
+ * delivering them at once, 0 delivers each message right away */
+#ifndef OUTBOX_LIMIT
+#define OUTBOX_LIMIT 64
+#endif
+
+/* Number of finished handler stacks each worker keeps for reuse */
+#ifndef SPARE_COROUTINES
+#define SPARE_COROUTINES 16
+#endif
+
+/* Largest payload of message sent to actor in another process */
+#ifndef SHM_PAYLOAD_LIMIT
+#define SHM_PAYLOAD_LIMIT 256
+#endif
+
+/* Number of slots in inbound ring of each process, power of two */
+#ifndef SHM_RING_SIZE
+#define SHM_RING_SIZE 1024
+#endif
+
+/* Milliseconds process waits for other node to set segment up or to
+ * publish message it claimed slot for, before giving up on it */
+#ifndef SHM_WAIT_MS
+#define SHM_WAIT_MS 5000
+#endif
+
+/* Message with non-zero deadline (CLOCK_MONOTONIC time in nanoseconds,
+ * see message_deadline) that is still queued after it passes is dropped
+ * instead of handled; MSG_SPAWN, MSG_GODIE and messages awaited by
+ * actor_await are always delivered. */
 typedef struct message
 {
     message_type_t message_type;
     size_t nbytes;
     void *data;
+    unsigned long long deadline;
 } message_t;
 
+/* Returns deadline ttl nanoseconds from now */
+unsigned long long message_deadline(unsigned long long ttl);
+
 typedef long actor_id_t;
 
+/* Actor id consists of node (process) number in high bits and index of
+ * actor within that node; ids of node 0 are plain indices. */
+#define ACTOR_NODE_SHIFT 48
+#define ACTOR_ID(node, local) ((actor_id_t) (((long) (node) << ACTOR_NODE_SHIFT) | (long) (local)))
+#define ACTOR_NODE(actor) ((size_t) ((unsigned long) (actor) >> ACTOR_NODE_SHIFT))
+#define ACTOR_LOCAL(actor) ((actor_id_t) ((actor) & ((1L << ACTOR_NODE_SHIFT) - 1)))
+
 actor_id_t actor_id_self();
 
 typedef void (*const act_t)(void **stateptr, size_t nbytes, void *data);
 
+/* Batch prompt gets count messages of one type at once, in order they
+ * were queued; array is valid only until prompt returns. */
+typedef void (*const act_batch_t)(void **stateptr, size_t count, const message_t *messages);
+
+/* Largest number of messages handed to batch prompt in one call */
+#ifndef BATCH_LIMIT
+#define BATCH_LIMIT 64
+#endif
+
+/* Snapshot callbacks: serialize writes the state into buffer (or only
+ * reports the required size when buffer is NULL) and returns its size,
+ * deserialize rebuilds a state from nbytes of previously written data. */
+typedef size_t (*serialize_t)(void *state, void *buffer, size_t size);
+typedef void *(*deserialize_t)(const void *buffer, size_t nbytes);
+
+/* Hooks run on runtime-managed state, right after allocation and right
+ * before it is reclaimed. They are called with runtime lock held, which
+ * stalls all workers meanwhile, so they have to be short, must not block
+ * and must not call into actor system. */
+typedef void (*state_hook_t)(void *state);
+
+/* When state_size is non-zero, runtime allocates state of that size for
+ * every actor of the role before MSG_HELLO is delivered (so *stateptr is
+ * already set) and reclaims it once actor is dead and its queue drained.
+ * Such state is snapshotted raw, serialize/deserialize are not used.
+ * Non-zero stack_size runs handlers of role on own stacks of that size,
+ * so that they may suspend in actor_await. Group is used by weighted
+ * scheduler. Batch_prompts, when set, has nprompts entries; message type
+ * with non-NULL entry is handled by it together with all messages of the
+ * same type that directly follow in mailbox (ignored for roles with
+ * stack). Name, when set, identifies role in profile report. */
 typedef struct role
 {
     size_t nprompts;
     act_t *prompts;
+    act_batch_t *batch_prompts;
+    serialize_t serialize;
+    deserialize_t deserialize;
+    size_t state_size;
+    state_hook_t state_init;
+    state_hook_t state_destroy;
+    size_t stack_size;
+    size_t group;
+    const char *name;
 } role_t;
 
+/* Order in which actors with pending messages are served: FIFO; LIFO,
+ * serving most recently scheduled actor while its data is still in cache
+ * but every LIFO_FAIRNESS-th turn the longest waiting one; or deficit
+ * round robin over role groups, group i getting group_weights[i] turns
+ * per round. */
+typedef enum scheduler_policy
+{
+    SCHEDULE_FIFO,
+    SCHEDULE_LIFO,
+    SCHEDULE_WEIGHTED
+} scheduler_policy_t;
+
+#ifndef LIFO_FAIRNESS
+#define LIFO_FAIRNESS 8
+#endif
+
+/* Backing of actor table and mailboxes. HUGE_PAGES_EXPLICIT backs
+ * mailboxes with pages reserved in system (vm.nr_hugepages), falling back
+ * to transparent ones when there are none; actor table gets transparent
+ * huge pages in both modes. */
+typedef enum huge_pages
+{
+    HUGE_PAGES_NONE,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+} huge_pages_t;
+
+/* Called for every message runtime drops, expired, evicted, discarded
+ * at shutdown or sent from handler and found undeliverable later, with
+ * runtime lock held; it may release message data but must not call into
+ * actor system. */
+typedef void (*drop_hook_t)(actor_id_t actor, const message_t *message);
+
+/* Zeroed fields keep defaults. Table and mailboxes are set up for
+ * expected_actors actors (512 by default) at creation, more actors get
+ * mailboxes mapped as they are spawned; each mailbox holds mailbox_size
+ * messages (ACTOR_QUEUE_LIMIT by default). With drop_oldest, message sent
+ * to full mailbox evicts the oldest queued one other than MSG_SPAWN,
+ * MSG_GODIE and MSG_HELLO instead of being refused (-3 is returned when
+ * there is no such message).
+ * On SIGINT, handlers that run are finished and queued messages are still
+ * handled for up to shutdown_drain_ms, the rest is discarded. */
+typedef struct actor_system_config
+{
+    scheduler_policy_t scheduler;
+    size_t ngroups;
+    const size_t *group_weights;
+    size_t expected_actors;
+    size_t mailbox_size;
+    huge_pages_t huge_pages;
+    int drop_oldest;
+    drop_hook_t drop_hook;
+    unsigned long shutdown_drain_ms;
+} actor_system_config_t;
+
+/* Numbers of messages dropped by last created actor system, available
+ * also after it is joined; undelivered counts messages that were accepted
+ * by send_message but refused when put into mailbox later */
+typedef struct actor_system_stats
+{
+    size_t expired;
+    size_t evicted;
+    size_t undelivered;
+} actor_system_stats_t;
+
+void actor_system_stats(actor_system_stats_t *stats);
+
 int actor_system_create(actor_id_t *actor, role_t *const role);
 
+int actor_system_create_config(actor_id_t *actor, role_t *const role,
+                               const actor_system_config_t *config);
+
 void actor_system_join(actor_id_t actor);
 
+/* Returns 0 when message is queued, -1 when actor is dead, system is shut
+ * down or memory runs out, -2 when actor does not exist and -3 when its
+ * mailbox is full. Messages sent from handlers with more than one worker
+ * (and non-zero OUTBOX_LIMIT) are queued when handler returns, so there
+ * only -2 and lack of memory are returned. With single worker, messages
+ * sent from other threads than the worker are handed over to it, so only
+ * shutdown and lack of memory are reported. Messages refused later go to
+ * drop hook and are counted as undelivered in actor_system_stats. */
 int send_message(actor_id_t actor, message_t message);
 
+/* Reference to actor resolved once, so that sends through it skip looking
+ * actor up. Send fails with -1 once actor is dead or reference outlived
+ * actor system it was resolved in; references to routers, remote actors
+ * and ones resolved by other threads than worker in single worker build
+ * fall back to send_message. */
+typedef struct actor_ref
+{
+    actor_id_t actor;
+    unsigned long generation;
+    message_t **mailbox;
+} actor_ref_t;
+
+int actor_ref_resolve(actor_ref_t *ref, actor_id_t actor);
+
+int send_message_ref(const actor_ref_t *ref, message_t message);
+
+/* Suspends handler until message of message_type arrives to this actor,
+ * without blocking worker; other messages stay queued until handler
+ * returns. Data of received message is valid until next actor_await or
+ * end of handler. Returns -1 outside of handler of role with stack, and
+ * once actor is dead or MSG_GODIE waits in its mailbox. */
+int actor_await(message_type_t message_type, message_t *message);
+
+/* Returns -2 when role of some actor is missing from roles and -1 on other
+ * errors, also when some handler is suspended in actor_await. */
+int actor_system_snapshot(const char *path, role_t *const *roles, size_t nroles);
+
+int actor_system_restore(actor_id_t *actor, const char *path,
+                         role_t *const *roles, size_t nroles);
+
+/* Restores snapshot into actor system set up as actor_system_create_config
+ * does with the same config */
+int actor_system_restore_config(actor_id_t *actor, const char *path,
+                                role_t *const *roles, size_t nroles,
+                                const actor_system_config_t *config);
+
+/* Routers forward every message sent to them straight into mailbox of
+ * one of target actors, chosen according to policy; ROUTE_HASH picks
+ * target by data (nbytes == 0) or by contents of payload. Dead targets
+ * are skipped; sending returns -1 once all of them are dead. Router is not
+ * counted as alive actor, MSG_GODIE sent to it stops routing. */
+typedef enum router_policy
+{
+    ROUTE_ROUND_ROBIN,
+    ROUTE_RANDOM,
+    ROUTE_HASH,
+    ROUTE_LEAST_LOADED
+} router_policy_t;
+
+int router_create(actor_id_t *router, router_policy_t policy,
+                  const actor_id_t *targets, size_t ntargets);
+
+/* Joins shared memory segment name as node out of nodes processes; has to
+ * be called before actor system is created. Messages to actors of other
+ * nodes get their nbytes of data copied into segment (at most
+ * SHM_PAYLOAD_LIMIT), messages with nbytes == 0 pass data as plain value.
+ * Returns -1 when segment is not set up by its creator within SHM_WAIT_MS
+ * or was created for other number of nodes. */
+int actor_system_attach(const char *name, size_t node, size_t nodes);
+
+void actor_system_detach();
+
 #endif
\ No newline at end of file
@@ -1,147 +1,557 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cacti.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
 #define MSG_COUNT 1
+#define MSG_CHILD 2
+#define MSG_SETUP 3
+#define MSG_FINISH 4
+
+/* Size of read buffer used when input can't be memory-mapped */
+#define INPUT_CHUNK 65536
+
+/* Number of rows flowing through column actors at the same time */
+#ifndef PIPELINE_WINDOW
+#define PIPELINE_WINDOW 16
+#endif
+
+#if PIPELINE_WINDOW < 1 || PIPELINE_WINDOW > ACTOR_QUEUE_LIMIT
+#error "PIPELINE_WINDOW has to be in range [1, ACTOR_QUEUE_LIMIT]"
+#endif
+
+/* Number of adjacent columns owned by one actor, summed by vector kernel */
+#ifndef COLUMN_BLOCK
+#define COLUMN_BLOCK 1
+#endif
+
+#if COLUMN_BLOCK < 1
+#error "COLUMN_BLOCK has to be positive"
+#endif
 
+/* Building with -DMACIERZ_BASELINE sums rows on main thread with the same
+ * kernel and no actors, as reference for MACIERZ_BENCH timings. */
+
+void hello_first(void **, size_t, void *);
 void hello_handler(void **, size_t, void *);
 void count_handler(void **, size_t, void *);
+void count_batch(void **, size_t, const message_t *);
+void child_handler(void **, size_t, void *);
+void setup_handler(void **, size_t, void *);
+void finish_handler(void **, size_t, void *);
 
 static size_t w;
 static size_t k;
 
-static int32_t *matrix;
-static int32_t *times;
+/* Number of column blocks, that is of actors */
+static size_t blocks;
+
 static int32_t *sums;
 
-static actor_id_t *ids;
+/* Row slots: main thread parses rows into free slots and sends them down
+ * the pipeline, last column frees slot once row is summed. */
+static sem_t free_slots;
+static sem_t pipeline_ready;
 
-static size_t actors_count = 0;
+/* Struct used as column actor state; column is index of block */
+typedef struct column {
+	size_t column;
 
-act_t prompts_array[] = { hello_handler, count_handler };
-role_t roles = (role_t) { .nprompts = 2, .prompts = prompts_array };
+	actor_id_t first;
+	actor_id_t next;
 
-size_t get_position(actor_id_t actor) {
-	size_t pos;
+	/* Used only by last column */
+	size_t rows_done;
+} column_t;
 
-	for(size_t i = 0; i < k; ++i)
-		if(ids[i] == actor)
-			pos = i;
-
-	return pos;
-}
+/* Struct passed to actor to assign its column */
+typedef struct setup {
+	size_t column;
+	actor_id_t first;
+} setup_t;
 
+/* Struct used as state of row flowing through columns */
 typedef struct state {
 	size_t row;
 	int32_t sum;
+
+	int32_t *values;
+	int32_t *times;
 } state_t;
 
+/* Input source; whole stdin is mapped when it is a regular file,
+ * otherwise it is read in INPUT_CHUNK pieces. */
+typedef struct input {
+	char *data;
+	size_t size;
+	size_t pos;
+
+	bool mapped;
+	char *chunk;
+} input_t;
+
+/* Kernels sum count values with wrap-around, same as int32_t additions */
+typedef int32_t (*kernel_t)(const int32_t *values, size_t count);
+
+static int32_t sum_scalar(const int32_t *values, size_t count) {
+	uint32_t sum = 0;
+
+	for(size_t i = 0; i < count; ++i) {
+		sum += (uint32_t) values[i];
+	}
+
+	return (int32_t) sum;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static int32_t sum_sse2(const int32_t *values, size_t count) {
+	__m128i acc = _mm_setzero_si128();
+	size_t i = 0;
+
+	for(; i + 4 <= count; i += 4) {
+		acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i *) (values + i)));
+	}
+
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return (int32_t) ((uint32_t) _mm_cvtsi128_si32(acc) + (uint32_t) sum_scalar(values + i, count - i));
+}
+
+__attribute__((target("avx2")))
+static int32_t sum_avx2(const int32_t *values, size_t count) {
+	__m256i acc = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for(; i + 8 <= count; i += 8) {
+		acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i *) (values + i)));
+	}
+
+	__m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return (int32_t) ((uint32_t) _mm_cvtsi128_si32(half) + (uint32_t) sum_scalar(values + i, count - i));
+}
+
+#endif
+
+static kernel_t sum_block = sum_scalar;
+
+/* Picks widest kernel supported by CPU running the program */
+static void kernel_select() {
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2")) {
+		sum_block = sum_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2")) {
+		sum_block = sum_sse2;
+	}
+#endif
+}
+
+act_t prompts_first[] = { hello_first, count_handler, child_handler, setup_handler, finish_handler };
+act_t prompts_array[] = { hello_handler, count_handler, child_handler, setup_handler, finish_handler };
+act_batch_t batch_prompts[] = { NULL, count_batch, NULL, NULL, NULL };
+
+role_t roles_first = (role_t) { .nprompts = 5, .prompts = prompts_first, .batch_prompts = batch_prompts,
+								.state_size = sizeof(column_t), .name = "column-first" };
+role_t roles = (role_t) { .nprompts = 5, .prompts = prompts_array, .batch_prompts = batch_prompts,
+						  .state_size = sizeof(column_t), .name = "column" };
 
-static state_t *computing_state;
+static void send_setup(actor_id_t actor, size_t column, actor_id_t first) {
+	setup_t *setup = malloc(sizeof(setup_t));
+
+	if(setup == NULL) {
+		perror("Critical: malloc");
+		exit(1);
+	}
+
+	setup->column = column;
+	setup->first = first;
+
+	send_message(actor, (message_t) { .message_type = MSG_SETUP,
+									  .nbytes = sizeof(setup_t),
+									  .data = (void *) setup });
+}
+
+/* First column waits for MSG_SETUP from main */
+void hello_first(__attribute__((unused)) void **stateptr,
+				 __attribute__((unused)) size_t nbytes,
+				 __attribute__((unused)) void *data) {
+}
 
 void hello_handler(__attribute__((unused)) void **stateptr,
 				   __attribute__((unused)) size_t nbytes,
-				   __attribute__((unused)) void *data) {
+				   void *data) {
+
+	actor_id_t parent = (actor_id_t) data;
+
+	send_message(parent, (message_t) { .message_type = MSG_CHILD,
+									   .nbytes = sizeof(actor_id_t),
+									   .data = (void *) actor_id_self() });
+}
+
+void child_handler(void **stateptr,
+				   __attribute__((unused)) size_t nbytes,
+				   void *data) {
+
+	column_t *my_state = (column_t *) *stateptr;
+
+	my_state->next = (actor_id_t) data;
+	send_setup(my_state->next, my_state->column + 1, my_state->first);
+}
+
+void setup_handler(void **stateptr,
+				   __attribute__((unused)) size_t nbytes,
+				   void *data) {
+
+	setup_t *setup = (setup_t *) data;
+	column_t *my_state = (column_t *) *stateptr;
 
-	ids[actors_count] = actor_id_self();
+	my_state->column = setup->column;
+	my_state->first = setup->first;
 
-	actors_count++;
+	free(setup);
 
-	if(actors_count < k) {
-		send_message(actor_id_self(), (message_t) { .message_type = MSG_SPAWN, 
-													.nbytes = sizeof(actor_id_t),
+	if(my_state->column < blocks - 1) {
+		send_message(actor_id_self(), (message_t) { .message_type = MSG_SPAWN,
+													.nbytes = sizeof(role_t *),
 													.data = &roles });
 	}
 	else {
-		computing_state = malloc(sizeof(state_t));
-		computing_state->row = 0;
-		computing_state->sum = sums[0];
-
-		send_message(ids[0], (message_t) { .message_type = MSG_COUNT,
-										   .nbytes = sizeof(computing_state),
-										   .data = (void *) computing_state});
+		sem_post(&pipeline_ready);
 	}
 }
 
-void count_handler(__attribute__((unused)) void **stateptr, 
-				   __attribute__((unused))size_t nbytes, 
+void count_handler(void **stateptr,
+				   __attribute__((unused)) size_t nbytes,
 				   void *data) {
 
 	state_t *current_state = (state_t *) data;
+	column_t *my_state = (column_t *) *stateptr;
 
 	size_t row_number = current_state->row;
-	size_t column_number = get_position(actor_id_self());
+	size_t column_number = my_state->column;
+
+	size_t begin = column_number * COLUMN_BLOCK;
+	size_t count = (k - begin < COLUMN_BLOCK) ? k - begin : COLUMN_BLOCK;
 
-	int32_t value = matrix[row_number * k + column_number];
+	int32_t value = sum_block(current_state->values + begin, count);
+	int32_t time = sum_block(current_state->times + begin, count);
 
-	usleep(times[row_number * k + column_number]*1000);
+	if(time > 0) {
+		usleep(time*1000);
+	}
 
-	sums[row_number] = (computing_state->sum + value);
-	current_state->sum = sums[row_number];
+	current_state->sum = (int32_t) ((uint32_t) current_state->sum + (uint32_t) value);
 
-	if(column_number < k - 1) {
-		send_message(ids[column_number + 1], (message_t) { .message_type = MSG_COUNT,
-														   .nbytes = sizeof(computing_state),
-														   .data = (void *) current_state});
+	if(column_number < blocks - 1) {
+		send_message(my_state->next, (message_t) { .message_type = MSG_COUNT,
+												   .nbytes = sizeof(state_t),
+												   .data = (void *) current_state});
 	}
 	else {
+		sums[row_number] = current_state->sum;
+		my_state->rows_done++;
 
-		if(row_number < w - 1) {
-			current_state->row = row_number + 1;
-			current_state->sum = 0;
+		sem_post(&free_slots);
 
-			send_message(ids[0], (message_t) { .message_type = MSG_COUNT,
-											   .nbytes = sizeof(computing_state),
-											   .data = (void *) current_state});
+		if(my_state->rows_done == w) {
+			send_message(my_state->first, (message_t) { .message_type = MSG_FINISH,
+														.nbytes = 0,
+														.data = NULL});
 		}
-		else {
-			for(size_t i = 0; i < k; ++i) {
-				send_message(ids[i], (message_t) { .message_type = MSG_GODIE,
+	}
+}
+
+/* Rows that queued up behind slow column are summed in one call */
+void count_batch(void **stateptr, size_t count, const message_t *messages) {
+	for(size_t i = 0; i < count; ++i) {
+		count_handler(stateptr, messages[i].nbytes, messages[i].data);
+	}
+}
+
+void finish_handler(void **stateptr,
+					__attribute__((unused)) size_t nbytes,
+					__attribute__((unused)) void *data) {
+
+	column_t *my_state = (column_t *) *stateptr;
+
+	if(my_state->column < blocks - 1) {
+		send_message(my_state->next, (message_t) { .message_type = MSG_FINISH,
 												   .nbytes = 0,
 												   .data = NULL});
-			}
+	}
+
+	send_message(actor_id_self(), (message_t) { .message_type = MSG_GODIE,
+												.nbytes = 0,
+												.data = NULL});
+}
+
+static void input_open(input_t *input) {
+	struct stat info;
+
+	input->pos = 0;
+	input->size = 0;
+	input->mapped = false;
+	input->chunk = NULL;
+
+	if(fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+		input->data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+
+		if(input->data != MAP_FAILED) {
+			madvise(input->data, (size_t) info.st_size, MADV_SEQUENTIAL);
+			input->size = (size_t) info.st_size;
+			input->mapped = true;
+			return;
 		}
 	}
+
+	if((input->chunk = malloc(INPUT_CHUNK)) == NULL) {
+		perror("Critical: malloc");
+		exit(1);
+	}
+
+	input->data = input->chunk;
 }
 
-int main(void) {
-	int err;
+static void input_close(input_t *input) {
+	if(input->mapped) {
+		munmap(input->data, input->size);
+	}
+
+	free(input->chunk);
+}
+
+/* Returns next character without consuming it, -1 at end of input */
+static int input_peek(input_t *input) {
+	if(input->pos == input->size) {
+		if(input->mapped) {
+			return -1;
+		}
+
+		ssize_t count = read(STDIN_FILENO, input->chunk, INPUT_CHUNK);
+
+		if(count <= 0) {
+			return -1;
+		}
+
+		input->pos = 0;
+		input->size = (size_t) count;
+	}
+
+	return (unsigned char) input->data[input->pos];
+}
+
+static bool input_number(input_t *input, long long *value) {
+	int c;
+	bool negative = false;
+
+	while((c = input_peek(input)) == ' ' || c == '\n' || c == '\t' || c == '\r') {
+		input->pos++;
+	}
+
+	if(c == '-' || c == '+') {
+		negative = (c == '-');
+		input->pos++;
+		c = input_peek(input);
+	}
+
+	if(c < '0' || c > '9') {
+		return false;
+	}
+
+	long long result = 0;
+
+	while((c = input_peek(input)) >= '0' && c <= '9') {
+		result = result * 10 + (c - '0');
+		input->pos++;
+	}
+
+	*value = negative ? -result : result;
 
-	scanf("%lu%lu", &w, &k);
+	return true;
+}
 
-	matrix = malloc(w * k * sizeof(int32_t));
-	times = malloc(w * k * sizeof(int32_t));
-	sums = malloc(w * sizeof(int32_t));
-	ids = malloc(k * sizeof(actor_id_t));
+/* Reads value and time of next k cells into row slot; terminates on
+ * malformed input, as rows are read while actor system runs */
+static void input_row(input_t *input, int32_t *values, int32_t *times) {
+	for(size_t j = 0; j < k; ++j) {
+		long long value = 0, time = 0;
+
+		if(!input_number(input, &value) || !input_number(input, &time)) {
+			fprintf(stderr, "Error: malformed input\n");
+			exit(1);
+		}
+
+		values[j] = (int32_t) value;
+		times[j] = (int32_t) time;
+	}
+}
+
+#ifdef MACIERZ_BASELINE
+
+static void sum_rows(input_t *input) {
+	int32_t *row = malloc(2 * k * sizeof(int32_t));
+
+	if(row == NULL) {
+		perror("Critical: malloc");
+		exit(1);
+	}
 
 	for(size_t i = 0; i < w; ++i) {
-		for(size_t j = 0; j < k; ++j) {
-			scanf("%d%d", &matrix[i * k + j], &times[i * k + j]);
+		input_row(input, row, row + k);
+
+		int32_t time = sum_block(row + k, k);
+
+		if(time > 0) {
+			usleep(time*1000);
 		}
 
-		sums[i] = 0;
+		sums[i] = sum_block(row, k);
+	}
+
+	free(row);
+}
+
+#else
+
+static void sum_rows(input_t *input) {
+	int err;
+
+	size_t window = (w < PIPELINE_WINDOW) ? w : PIPELINE_WINDOW;
+	state_t *computing_states = malloc(window * sizeof(state_t));
+	int32_t *slots = malloc(2 * window * k * sizeof(int32_t));
+
+	if(computing_states == NULL || slots == NULL) {
+		perror("Critical: malloc");
+		exit(1);
+	}
+
+	for(size_t i = 0; i < window; ++i) {
+		computing_states[i].values = slots + 2 * i * k;
+		computing_states[i].times = slots + (2 * i + 1) * k;
 	}
 
+	sem_init(&free_slots, 0, window);
+	sem_init(&pipeline_ready, 0, 0);
+
 	actor_id_t first_actor;
 
-	if((err = actor_system_create(&first_actor, &roles)) != 0) {
+	if((err = actor_system_create(&first_actor, &roles_first)) != 0) {
 		perror("Error in creating actor system...\n");
-		return 1;
+		exit(1);
+	}
+
+	send_setup(first_actor, 0, first_actor);
+
+	sem_wait(&pipeline_ready);
+
+	/* Parse rows while previous ones are being summed */
+	for(size_t i = 0; i < w; ++i) {
+		state_t *state = &computing_states[i % window];
+
+		sem_wait(&free_slots);
+
+		input_row(input, state->values, state->times);
+
+		state->row = i;
+		state->sum = 0;
+
+		send_message(first_actor, (message_t) { .message_type = MSG_COUNT,
+												.nbytes = sizeof(state_t),
+												.data = (void *) state });
 	}
 
 	actor_system_join(first_actor);
 
+	sem_destroy(&free_slots);
+	sem_destroy(&pipeline_ready);
+
+	free(slots);
+	free(computing_states);
+}
+
+#endif
+
+int main(void) {
+	long long rows, columns;
+	input_t input;
+
+	input_open(&input);
+
+	if(!input_number(&input, &rows) || !input_number(&input, &columns) ||
+	   rows < 0 || columns < 0) {
+
+		fprintf(stderr, "Error: malformed input\n");
+		input_close(&input);
+		return 1;
+	}
+
+	w = (size_t) rows;
+	k = (size_t) columns;
+	blocks = (k + COLUMN_BLOCK - 1) / COLUMN_BLOCK;
+
+	if((sums = calloc(w, sizeof(int32_t))) == NULL && w > 0) {
+		perror("Critical: malloc");
+		return 1;
+	}
+
+	if(w == 0 || k == 0) {
+		for(size_t i = 0; i < w; ++i) {
+			printf("%d\n", sums[i]);
+		}
+
+		free(sums);
+		input_close(&input);
+
+		return 0;
+	}
+
+	kernel_select();
+
+#ifdef MACIERZ_BENCH
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+
+	sum_rows(&input);
+
+#ifdef MACIERZ_BENCH
+	clock_gettime(CLOCK_MONOTONIC, &end);
+#ifdef MACIERZ_BASELINE
+	fprintf(stderr, "baseline: %.3f ms\n",
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+#else
+	fprintf(stderr, "window %d, %zu blocks of %d columns: %.3f ms\n", PIPELINE_WINDOW, blocks, COLUMN_BLOCK,
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+#endif
+#endif
+
 	for(size_t i = 0; i < w; ++i) {
 		printf("%d\n", sums[i]);
 	}
 
-	free(matrix);
-	free(times);
+	input_close(&input);
+
 	free(sums);
-	free(ids);
-	free(computing_state);
 
 	return 0;
 }
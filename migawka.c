@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "cacti.h"
+
+/* First actor spawns COUNTERS counters and sends each of them ADDS
+ * messages. Once system is idle, main thread takes its snapshot, lets the
+ * counters report their sums and die, then restores system from snapshot
+ * and lets them report again; restored counters have to report the same
+ * sums. Usage:
+ *
+ *     migawka [path]
+ */
+
+#define MSG_REGISTER 1
+#define MSG_ADD 2
+#define MSG_REPORT 3
+
+#define COUNTERS 8
+#define ADDS 100
+
+void root_hello(void **, size_t, void *);
+void register_handler(void **, size_t, void *);
+void root_report(void **, size_t, void *);
+void counter_hello(void **, size_t, void *);
+void add_handler(void **, size_t, void *);
+void counter_report(void **, size_t, void *);
+
+/* State of first actor, restored with ids of its counters */
+typedef struct root {
+	actor_id_t counters[COUNTERS];
+	size_t registered;
+} root_t;
+
+typedef struct counter {
+	long index;
+	long sum;
+} counter_t;
+
+act_t prompts_root[] = { root_hello, register_handler, NULL, root_report };
+act_t prompts_counter[] = { counter_hello, NULL, add_handler, counter_report };
+
+role_t role_root = (role_t) { .nprompts = 4, .prompts = prompts_root,
+							  .state_size = sizeof(root_t), .name = "root" };
+role_t role_counter = (role_t) { .nprompts = 4, .prompts = prompts_counter,
+								 .state_size = sizeof(counter_t), .name = "counter" };
+
+/* Sums reported by counters in current run */
+static long sums[COUNTERS];
+static long reports;
+
+void root_hello(__attribute__((unused)) void **stateptr,
+				__attribute__((unused)) size_t nbytes,
+				__attribute__((unused)) void *data) {
+
+	for(size_t i = 0; i < COUNTERS; ++i) {
+		send_message(actor_id_self(), (message_t) { .message_type = MSG_SPAWN,
+													.nbytes = sizeof(role_t *),
+													.data = &role_counter });
+	}
+}
+
+/* Counter i gets numbers i + 1, ..., i + ADDS */
+void register_handler(void **stateptr,
+					  __attribute__((unused)) size_t nbytes,
+					  void *data) {
+
+	root_t *my_state = (root_t *) *stateptr;
+	size_t index = my_state->registered++;
+
+	my_state->counters[index] = (actor_id_t) data;
+
+	send_message(my_state->counters[index], (message_t) { .message_type = MSG_REPORT,
+														  .data = (void *) -(long) index - 1 });
+
+	for(long i = 1; i <= ADDS; ++i) {
+		send_message(my_state->counters[index], (message_t) { .message_type = MSG_ADD,
+															  .data = (void *) ((long) index + i) });
+	}
+}
+
+void root_report(void **stateptr,
+				 __attribute__((unused)) size_t nbytes,
+				 __attribute__((unused)) void *data) {
+
+	root_t *my_state = (root_t *) *stateptr;
+
+	for(size_t i = 0; i < my_state->registered; ++i) {
+		send_message(my_state->counters[i], (message_t) { .message_type = MSG_REPORT });
+	}
+
+	send_message(actor_id_self(), (message_t) { .message_type = MSG_GODIE });
+}
+
+void counter_hello(__attribute__((unused)) void **stateptr,
+				   __attribute__((unused)) size_t nbytes,
+				   void *data) {
+
+	send_message((actor_id_t) data, (message_t) { .message_type = MSG_REGISTER,
+												  .data = (void *) actor_id_self() });
+}
+
+void add_handler(void **stateptr,
+				 __attribute__((unused)) size_t nbytes,
+				 void *data) {
+
+	((counter_t *) *stateptr)->sum += (long) data;
+}
+
+/* Negative data only tells counter its index, sent before first number */
+void counter_report(void **stateptr,
+					__attribute__((unused)) size_t nbytes,
+					void *data) {
+
+	counter_t *my_state = (counter_t *) *stateptr;
+
+	if((long) data < 0) {
+		my_state->index = -(long) data - 1;
+		return;
+	}
+
+	sums[my_state->index] = my_state->sum;
+	__atomic_add_fetch(&reports, 1, __ATOMIC_RELAXED);
+
+	send_message(actor_id_self(), (message_t) { .message_type = MSG_GODIE });
+}
+
+/* Lets all counters report and waits until system ends */
+static int report(actor_id_t actor, long *result) {
+	reports = 0;
+
+	if(send_message(actor, (message_t) { .message_type = MSG_REPORT }) != 0)
+		return -1;
+
+	actor_system_join(actor);
+
+	for(size_t i = 0; i < COUNTERS; ++i) {
+		result[i] = sums[i];
+	}
+
+	return reports == COUNTERS ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+	const char *path = argc > 1 ? argv[1] : "migawka.snap";
+	role_t *roles[] = { &role_root, &role_counter };
+
+	long before[COUNTERS];
+	long after[COUNTERS];
+	actor_id_t actor;
+
+	if(actor_system_create(&actor, &role_root) != 0) {
+		fprintf(stderr, "Could not create actor system\n");
+		return 1;
+	}
+
+	if(actor_system_snapshot(path, roles, 2) != 0) {
+		fprintf(stderr, "Could not write snapshot to %s\n", path);
+		return 1;
+	}
+
+	if(report(actor, before) != 0) {
+		fprintf(stderr, "Counters did not report\n");
+		return 1;
+	}
+
+	if(actor_system_restore(&actor, path, roles, 2) != 0) {
+		fprintf(stderr, "Could not restore snapshot from %s\n", path);
+		return 1;
+	}
+
+	if(report(actor, after) != 0) {
+		fprintf(stderr, "Restored counters did not report\n");
+		return 1;
+	}
+
+	int failed = 0;
+
+	for(size_t i = 0; i < COUNTERS; ++i) {
+		long expected = ADDS * (long) i + ADDS * (ADDS + 1) / 2;
+
+		printf("%zu %ld %ld\n", i, before[i], after[i]);
+
+		if(before[i] != expected || after[i] != expected) {
+			failed = 1;
+		}
+	}
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+
+	return failed;
+}
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cacti.h"
+
+/* Compares scheduling policies on the same workloads. Usage:
+ *
+ *     planista fifo|lifo|weighted [fanout|ping|groups]
+ *
+ * fanout: first actor spawns WORKERS actors and sends one message to each
+ * of them in every of ROUNDS rounds, acknowledged by workers, with at most
+ * WINDOW rounds in flight; ping: one actor sends itself PINGS messages one
+ * after another; groups: GROUP_ACTORS actors in each of two groups
+ * (weights 3 and 1) keep sending to themselves, and share of turns each
+ * group got before TURNS turns were served is printed. Run fails when any
+ * message is lost, as its numbers would not be comparable. */
+
+#define MSG_REGISTER 1
+#define MSG_WORK 2
+#define MSG_ACK 3
+
+#ifndef WORKERS
+#define WORKERS 100
+#endif
+
+#ifndef ROUNDS
+#define ROUNDS 2000
+#endif
+
+#ifndef WINDOW
+#define WINDOW 8
+#endif
+
+/* Acknowledgements of rounds in flight have to fit into mailbox of first
+ * actor */
+#if WINDOW * WORKERS >= ACTOR_QUEUE_LIMIT
+#error "WINDOW * WORKERS has to be below ACTOR_QUEUE_LIMIT"
+#endif
+
+#ifndef PINGS
+#define PINGS 1000000
+#endif
+
+#ifndef GROUP_ACTORS
+#define GROUP_ACTORS 8
+#endif
+
+#ifndef TURNS
+#define TURNS 400000
+#endif
+
+void root_hello(void **, size_t, void *);
+void register_handler(void **, size_t, void *);
+void ack_handler(void **, size_t, void *);
+void worker_hello(void **, size_t, void *);
+void work_handler(void **, size_t, void *);
+void ping_hello(void **, size_t, void *);
+void ping_handler(void **, size_t, void *);
+void group_hello(void **, size_t, void *);
+void first_group_handler(void **, size_t, void *);
+void second_group_handler(void **, size_t, void *);
+
+/* State of first actor of fan-out */
+typedef struct fanout {
+	actor_id_t workers[WORKERS];
+	size_t registered;
+	size_t rounds_sent;
+	size_t acks;
+} fanout_t;
+
+act_t prompts_root[] = { root_hello, register_handler, NULL, ack_handler };
+act_t prompts_worker[] = { worker_hello, NULL, work_handler };
+act_t prompts_ping[] = { ping_hello, NULL, ping_handler };
+act_t prompts_first_group[] = { group_hello, NULL, first_group_handler };
+act_t prompts_second_group[] = { group_hello, NULL, second_group_handler };
+
+role_t role_root = (role_t) { .nprompts = 4, .prompts = prompts_root,
+							  .state_size = sizeof(fanout_t), .name = "fanout" };
+role_t role_worker = (role_t) { .nprompts = 3, .prompts = prompts_worker, .name = "worker" };
+role_t role_ping = (role_t) { .nprompts = 3, .prompts = prompts_ping, .name = "ping" };
+role_t role_group[2] = {
+	(role_t) { .nprompts = 3, .prompts = prompts_first_group, .group = 0, .name = "group-0" },
+	(role_t) { .nprompts = 3, .prompts = prompts_second_group, .group = 1, .name = "group-1" }
+};
+
+static const size_t weights[2] = { 3, 1 };
+
+static long handled;
+static long pings_left = PINGS;
+static long turns;
+static long group_turns[2];
+
+/* Messages refused at send or dropped by runtime later */
+static long lost;
+
+static void lost_message(__attribute__((unused)) actor_id_t actor,
+						 __attribute__((unused)) const message_t *message) {
+
+	__atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+}
+
+static void send_checked(actor_id_t actor, message_t message) {
+	if(send_message(actor, message) != 0) {
+		__atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void send_work(actor_id_t actor) {
+	send_checked(actor, (message_t) { .message_type = MSG_WORK });
+}
+
+static void send_godie(actor_id_t actor) {
+	send_checked(actor, (message_t) { .message_type = MSG_GODIE });
+}
+
+/*
+ * -------------------------------------
+ * Fan-out
+ * -------------------------------------
+ */
+
+void root_hello(__attribute__((unused)) void **stateptr,
+				__attribute__((unused)) size_t nbytes,
+				__attribute__((unused)) void *data) {
+
+	for(size_t i = 0; i < WORKERS; ++i) {
+		send_checked(actor_id_self(), (message_t) { .message_type = MSG_SPAWN,
+													.nbytes = sizeof(role_t *),
+													.data = &role_worker });
+	}
+}
+
+static void send_round(fanout_t *my_state) {
+	for(size_t i = 0; i < WORKERS; ++i) {
+		send_checked(my_state->workers[i], (message_t) { .message_type = MSG_WORK,
+														 .data = (void *) actor_id_self() });
+	}
+
+	my_state->rounds_sent++;
+}
+
+void register_handler(void **stateptr,
+					  __attribute__((unused)) size_t nbytes,
+					  void *data) {
+
+	fanout_t *my_state = (fanout_t *) *stateptr;
+
+	my_state->workers[my_state->registered++] = (actor_id_t) data;
+
+	if(my_state->registered < WORKERS) {
+		return;
+	}
+
+	while(my_state->rounds_sent < WINDOW && my_state->rounds_sent < ROUNDS) {
+		send_round(my_state);
+	}
+}
+
+/* Next round is sent once acknowledgements of whole round came */
+void ack_handler(void **stateptr,
+				 __attribute__((unused)) size_t nbytes,
+				 __attribute__((unused)) void *data) {
+
+	fanout_t *my_state = (fanout_t *) *stateptr;
+
+	if(++my_state->acks % WORKERS != 0) {
+		return;
+	}
+
+	if(my_state->rounds_sent < ROUNDS) {
+		send_round(my_state);
+		return;
+	}
+
+	if(my_state->acks < (size_t) ROUNDS * WORKERS) {
+		return;
+	}
+
+	for(size_t i = 0; i < WORKERS; ++i) {
+		send_godie(my_state->workers[i]);
+	}
+
+	send_godie(actor_id_self());
+}
+
+void worker_hello(__attribute__((unused)) void **stateptr,
+				  __attribute__((unused)) size_t nbytes,
+				  void *data) {
+
+	send_checked((actor_id_t) data, (message_t) { .message_type = MSG_REGISTER,
+												  .data = (void *) actor_id_self() });
+}
+
+void work_handler(__attribute__((unused)) void **stateptr,
+				  __attribute__((unused)) size_t nbytes,
+				  void *data) {
+
+	__atomic_add_fetch(&handled, 1, __ATOMIC_RELAXED);
+
+	send_checked((actor_id_t) data, (message_t) { .message_type = MSG_ACK });
+}
+
+/*
+ * -------------------------------------
+ * Ping
+ * -------------------------------------
+ */
+
+void ping_hello(__attribute__((unused)) void **stateptr,
+				__attribute__((unused)) size_t nbytes,
+				__attribute__((unused)) void *data) {
+
+	send_work(actor_id_self());
+}
+
+void ping_handler(__attribute__((unused)) void **stateptr,
+				  __attribute__((unused)) size_t nbytes,
+				  __attribute__((unused)) void *data) {
+
+	handled++;
+
+	if(--pings_left > 0) {
+		send_work(actor_id_self());
+	}
+	else {
+		send_godie(actor_id_self());
+	}
+}
+
+/*
+ * -------------------------------------
+ * Groups
+ * -------------------------------------
+ */
+
+void group_hello(__attribute__((unused)) void **stateptr,
+				 __attribute__((unused)) size_t nbytes,
+				 __attribute__((unused)) void *data) {
+
+	/* First actor spawns the rest, half of them in second group */
+	if(actor_id_self() == 0) {
+		for(size_t i = 1; i < 2 * GROUP_ACTORS; ++i) {
+			send_checked(actor_id_self(), (message_t) { .message_type = MSG_SPAWN,
+														.nbytes = sizeof(role_t *),
+														.data = &role_group[i % 2] });
+		}
+	}
+
+	/* Several messages keep actor scheduled while its turn is served */
+	for(int i = 0; i < 4; ++i) {
+		send_work(actor_id_self());
+	}
+}
+
+static void group_turn(size_t group) {
+	long turn = __atomic_add_fetch(&turns, 1, __ATOMIC_RELAXED);
+
+	if(turn > TURNS) {
+		send_godie(actor_id_self());
+		return;
+	}
+
+	__atomic_add_fetch(&group_turns[group], 1, __ATOMIC_RELAXED);
+
+	send_work(actor_id_self());
+}
+
+void first_group_handler(__attribute__((unused)) void **stateptr,
+						 __attribute__((unused)) size_t nbytes,
+						 __attribute__((unused)) void *data) {
+
+	group_turn(0);
+}
+
+void second_group_handler(__attribute__((unused)) void **stateptr,
+						  __attribute__((unused)) size_t nbytes,
+						  __attribute__((unused)) void *data) {
+
+	group_turn(1);
+}
+
+/*
+ * -------------------------------------
+ * Driver
+ * -------------------------------------
+ */
+
+static double elapsed_ms(struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (double) (end.tv_sec - start->tv_sec) * 1e3 + (double) (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+	static const char *policies[] = { "fifo", "lifo", "weighted" };
+	static const scheduler_policy_t values[] = { SCHEDULE_FIFO, SCHEDULE_LIFO, SCHEDULE_WEIGHTED };
+
+	const char *workload = argc > 2 ? argv[2] : "fanout";
+	int policy = -1;
+
+	for(int i = 0; i < 3 && argc > 1; ++i) {
+		if(strcmp(argv[1], policies[i]) == 0) {
+			policy = i;
+		}
+	}
+
+	role_t *first;
+
+	if(strcmp(workload, "fanout") == 0) {
+		first = &role_root;
+	}
+	else if(strcmp(workload, "ping") == 0) {
+		first = &role_ping;
+	}
+	else if(strcmp(workload, "groups") == 0) {
+		first = &role_group[0];
+	}
+	else {
+		first = NULL;
+	}
+
+	if(policy < 0 || first == NULL) {
+		fprintf(stderr, "Usage: %s fifo|lifo|weighted [fanout|ping|groups]\n", argv[0]);
+		return 1;
+	}
+
+	actor_system_config_t config = { .scheduler = values[policy], .ngroups = 2,
+									 .group_weights = weights, .drop_hook = lost_message };
+	actor_id_t actor;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(actor_system_create_config(&actor, first, &config) != 0) {
+		fprintf(stderr, "Could not create actor system\n");
+		return 1;
+	}
+
+	actor_system_join(actor);
+
+	double ms = elapsed_ms(&start);
+
+	printf("%s %s: %ld messages in %.1f ms", policies[policy], workload,
+		   strcmp(workload, "groups") == 0 ? group_turns[0] + group_turns[1] : handled, ms);
+
+	if(strcmp(workload, "ping") == 0) {
+		printf(", %.1f ns/msg", ms * 1e6 / (double) handled);
+	}
+	else if(strcmp(workload, "groups") == 0) {
+		printf(", group 0 got %.1f%% of turns", 100.0 * (double) group_turns[0] /
+												 (double) (group_turns[0] + group_turns[1]));
+	}
+
+	printf("\n");
+
+	if(lost > 0) {
+		fprintf(stderr, "%ld messages lost, run is not comparable\n", lost);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "cacti.h"
+
+/* First actor spawns TARGETS actors and kills the first of them. Once it
+ * is dead, router of every policy is created over all targets and gets
+ * MESSAGES messages, which all have to reach targets that are alive (and
+ * for ROUTE_HASH, messages with the same data the same target). Router
+ * whose only target is dead has to refuse message. */
+
+#define MSG_REGISTER 1
+#define MSG_WAIT 2
+#define MSG_FINISH 3
+#define MSG_ROUTED 4
+
+#define TARGETS 4
+#define POLICIES 4
+#define MESSAGES 100
+#define KEYS 10
+
+void dispatcher_hello(void **, size_t, void *);
+void register_handler(void **, size_t, void *);
+void wait_handler(void **, size_t, void *);
+void finish_handler(void **, size_t, void *);
+void target_hello(void **, size_t, void *);
+void routed_handler(void **, size_t, void *);
+
+act_t prompts_dispatcher[] = { dispatcher_hello, register_handler, wait_handler, finish_handler };
+act_t prompts_target[] = { target_hello, NULL, NULL, NULL, routed_handler };
+
+role_t role_dispatcher = (role_t) { .nprompts = 4, .prompts = prompts_dispatcher,
+									.name = "dispatcher" };
+role_t role_target = (role_t) { .nprompts = 5, .prompts = prompts_target, .name = "target" };
+
+static const char *policy_names[POLICIES] = { "round-robin", "random", "hash", "least-loaded" };
+
+/* Written by first actor only, read by targets after they are set */
+static actor_id_t targets[TARGETS];
+static size_t registered;
+
+static actor_id_t routers[POLICIES + 1];
+static long refused;
+static int dead_router_err;
+
+/* Messages routed to every target by each policy */
+static long received[POLICIES][TARGETS];
+
+/* Target chosen for each key by ROUTE_HASH, -1 before first message */
+static long hash_targets[KEYS];
+static long hash_mismatches;
+
+void dispatcher_hello(__attribute__((unused)) void **stateptr,
+					  __attribute__((unused)) size_t nbytes,
+					  __attribute__((unused)) void *data) {
+
+	for(size_t i = 0; i < TARGETS; ++i) {
+		send_message(actor_id_self(), (message_t) { .message_type = MSG_SPAWN,
+													.nbytes = sizeof(role_t *),
+													.data = &role_target });
+	}
+}
+
+void register_handler(__attribute__((unused)) void **stateptr,
+					  __attribute__((unused)) size_t nbytes,
+					  void *data) {
+
+	targets[registered++] = (actor_id_t) data;
+
+	if(registered < TARGETS) {
+		return;
+	}
+
+	send_message(targets[0], (message_t) { .message_type = MSG_GODIE });
+	send_message(actor_id_self(), (message_t) { .message_type = MSG_WAIT });
+}
+
+/* Routes messages once first target is dead, resolving reference to it
+ * fails only then */
+void wait_handler(__attribute__((unused)) void **stateptr,
+				  __attribute__((unused)) size_t nbytes,
+				  __attribute__((unused)) void *data) {
+
+	actor_ref_t ref;
+
+	if(actor_ref_resolve(&ref, targets[0]) != -1) {
+		send_message(actor_id_self(), (message_t) { .message_type = MSG_WAIT });
+		return;
+	}
+
+	for(long policy = 0; policy < POLICIES; ++policy) {
+		if(router_create(&routers[policy], (router_policy_t) policy, targets, TARGETS) != 0) {
+			fprintf(stderr, "Could not create %s router\n", policy_names[policy]);
+			exit(1);
+		}
+
+		for(long i = 0; i < MESSAGES; ++i) {
+			message_t message = { .message_type = MSG_ROUTED,
+								  .data = (void *) (policy * MESSAGES + i % KEYS) };
+
+			if(send_message(routers[policy], message) != 0) {
+				refused++;
+			}
+		}
+	}
+
+	/* Router over dead target alone */
+	if(router_create(&routers[POLICIES], ROUTE_ROUND_ROBIN, targets, 1) != 0) {
+		fprintf(stderr, "Could not create router\n");
+		exit(1);
+	}
+
+	dead_router_err = send_message(routers[POLICIES], (message_t) { .message_type = MSG_ROUTED });
+
+	/* Targets die once messages routed above are in their mailboxes */
+	send_message(actor_id_self(), (message_t) { .message_type = MSG_FINISH });
+}
+
+void finish_handler(__attribute__((unused)) void **stateptr,
+					__attribute__((unused)) size_t nbytes,
+					__attribute__((unused)) void *data) {
+
+	for(size_t i = 0; i <= POLICIES; ++i) {
+		send_message(routers[i], (message_t) { .message_type = MSG_GODIE });
+	}
+
+	for(size_t i = 1; i < TARGETS; ++i) {
+		send_message(targets[i], (message_t) { .message_type = MSG_GODIE });
+	}
+
+	send_message(actor_id_self(), (message_t) { .message_type = MSG_GODIE });
+}
+
+void target_hello(__attribute__((unused)) void **stateptr,
+				  __attribute__((unused)) size_t nbytes,
+				  void *data) {
+
+	send_message((actor_id_t) data, (message_t) { .message_type = MSG_REGISTER,
+												  .data = (void *) actor_id_self() });
+}
+
+void routed_handler(__attribute__((unused)) void **stateptr,
+					__attribute__((unused)) size_t nbytes,
+					void *data) {
+
+	long policy = (long) data / MESSAGES;
+	long key = (long) data % MESSAGES;
+	long target = 0;
+
+	while(targets[target] != actor_id_self()) {
+		target++;
+	}
+
+	__atomic_add_fetch(&received[policy][target], 1, __ATOMIC_RELAXED);
+
+	if(policy == ROUTE_HASH) {
+		long expected = -1;
+
+		if(!__atomic_compare_exchange_n(&hash_targets[key], &expected, target, false,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED) && expected != target) {
+
+			__atomic_add_fetch(&hash_mismatches, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int main() {
+	actor_id_t actor;
+
+	for(size_t i = 0; i < KEYS; ++i) {
+		hash_targets[i] = -1;
+	}
+
+	if(actor_system_create(&actor, &role_dispatcher) != 0) {
+		fprintf(stderr, "Could not create actor system\n");
+		return 1;
+	}
+
+	actor_system_join(actor);
+
+	actor_system_stats_t stats;
+	actor_system_stats(&stats);
+
+	int failed = 0;
+
+	for(size_t policy = 0; policy < POLICIES; ++policy) {
+		long total = 0;
+
+		printf("%-13s", policy_names[policy]);
+
+		for(size_t i = 0; i < TARGETS; ++i) {
+			printf(" %4ld", received[policy][i]);
+			total += received[policy][i];
+		}
+
+		printf("\n");
+
+		if(total != MESSAGES || received[policy][0] != 0) {
+			failed = 1;
+		}
+	}
+
+	/* Refusal by router with dead target shows up as undelivered when
+	 * sent through outbox */
+	size_t dead_refusals = (dead_router_err != 0 ? 1 : 0) + stats.undelivered;
+
+	if(refused != 0 || dead_refusals != 1 || hash_mismatches != 0) {
+		failed = 1;
+	}
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+
+	return failed;
+}
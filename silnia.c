@@ -2,10 +2,18 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <stdbool.h>
 #include <assert.h>
 #include "cacti.h"
 
+/* Ranges of at most LEAF_RANGE factors are multiplied by single actor
+ * in tree mode (default); -DSILNIA_SEQUENTIAL selects original chain */
+#ifndef LEAF_RANGE
+#define LEAF_RANGE 64
+#endif
+
 /* Actor functions prototypes */
 void hello_handler(void **, size_t, void *);
 void callback_handler(void **, size_t, void *);
@@ -14,12 +22,31 @@ void hello_second(void **, size_t, void *);
 void clear_handler(void **, size_t, void *);
 void count_handler(void **, size_t, void *);
 
+void hello_root(void **, size_t, void *);
+void hello_node(void **, size_t, void *);
+void range_handler(void **, size_t, void *);
+void child_handler(void **, size_t, void *);
+void result_handler(void **, size_t, void *);
+
 /* Message codes */
 #define MSG_CLEAR 1
 #define MSG_CALLBACK 2
 #define MSG_COUNT 3
 #define MSG_INIT 3
 
+/* Message codes of tree mode */
+#define MSG_RANGE 1
+#define MSG_CHILD 2
+#define MSG_RESULT 3
+
+/* Arbitrary precision number, little-endian limbs in base 10^9 */
+#define BIGNUM_BASE 1000000000u
+
+typedef struct bignum {
+	size_t size;
+	uint32_t limbs[];
+} bignum_t;
+
 /* Struct used as actor computation state */
 typedef struct actor_state {
 	bool first;
@@ -39,20 +66,50 @@ typedef struct state {
 	unsigned long long int *result_pointer;
 } state_t;
 
+/* Struct used as state of tree mode actor, responsible for [low, high] */
+typedef struct node_state {
+	bool root;
+	actor_id_t parent;
+
+	unsigned long long low;
+	unsigned long long high;
+
+	size_t children;
+	size_t results;
+	bignum_t *partial;
+} node_state_t;
+
+/* Struct passed to tree mode actor to assign its range */
+typedef struct range {
+	unsigned long long low;
+	unsigned long long high;
+} range_t;
+
 /* Actor functions arrays */
 act_t prompts_array[] = { hello_handler, clear_handler, callback_handler, init_handler };
 act_t prompts_second[] = { hello_second, clear_handler, callback_handler, count_handler };
 
-/* Actor roles */
-role_t roles = (role_t) { .nprompts = 4, .prompts = prompts_array};
-role_t roles_more = (role_t) { .nprompts = 4, .prompts = prompts_second};
+/* Actor roles; states are allocated and reclaimed by runtime */
+role_t roles = (role_t) { .nprompts = 4, .prompts = prompts_array,
+						  .state_size = sizeof(actor_state_t), .name = "silnia" };
+role_t roles_more = (role_t) { .nprompts = 4, .prompts = prompts_second,
+							   .state_size = sizeof(actor_state_t), .name = "silnia-more" };
+
+act_t prompts_root[] = { hello_root, range_handler, child_handler, result_handler };
+act_t prompts_node[] = { hello_node, range_handler, child_handler, result_handler };
+
+role_t roles_root = (role_t) { .nprompts = 4, .prompts = prompts_root,
+							   .state_size = sizeof(node_state_t), .name = "tree-root" };
+role_t roles_node = (role_t) { .nprompts = 4, .prompts = prompts_node,
+							   .state_size = sizeof(node_state_t), .name = "tree-node" };
+
+/* Written by root actor of tree mode before it dies */
+static bignum_t *tree_result = NULL;
 
 void hello_handler(void **stateptr, 
 				   __attribute__((unused)) size_t nbytes,
 				   __attribute__((unused)) void *data) {
 
-	*stateptr = malloc(sizeof(actor_state_t));
-
 	actor_state_t *ptr = (actor_state_t *) *stateptr;
 
 	ptr->first = true;
@@ -96,7 +153,6 @@ void hello_second(void **stateptr,
 				  __attribute__((unused)) size_t nbytes,
 				  void *data) {
 
-	*stateptr = malloc(sizeof(actor_state_t));
 	actor_state_t *my_state = (actor_state_t *) *stateptr;
 
 	my_state->parent = (actor_id_t) data;
@@ -139,23 +195,254 @@ void clear_handler(void **stateptr,
 													 .data = NULL});
 	}
 
-	free(*stateptr);
 	send_message(actor_id_self(), (message_t) { .message_type = MSG_GODIE,
 												.nbytes = 0,
 											 	.data = NULL});
 }
 
+/* Tree mode */
+
+static bignum_t *bignum_alloc(size_t size) {
+	bignum_t *number = malloc(sizeof(bignum_t) + size * sizeof(uint32_t));
+
+	if(number == NULL) {
+		perror("Critical: malloc");
+		exit(1);
+	}
+
+	number->size = size;
+	memset(number->limbs, 0, size * sizeof(uint32_t));
+
+	return number;
+}
+
+static void bignum_trim(bignum_t *number) {
+	while(number->size > 1 && number->limbs[number->size - 1] == 0) {
+		number->size--;
+	}
+}
+
+/* Product of all integers in [low, high], 1 for empty range;
+ * high has to be below BIGNUM_BASE */
+static bignum_t *bignum_range_product(unsigned long long low, unsigned long long high) {
+	bignum_t *result = bignum_alloc(high >= low ? (size_t) (high - low + 2) : 1);
+	size_t size = 1;
+
+	result->limbs[0] = 1;
+
+	for(unsigned long long factor = (low > 0 ? low : 1); factor <= high; ++factor) {
+		uint64_t carry = 0;
+
+		for(size_t i = 0; i < size; ++i) {
+			uint64_t current = (uint64_t) result->limbs[i] * factor + carry;
+
+			result->limbs[i] = (uint32_t) (current % BIGNUM_BASE);
+			carry = current / BIGNUM_BASE;
+		}
+
+		if(carry > 0) {
+			result->limbs[size++] = (uint32_t) carry;
+		}
+	}
+
+	result->size = size;
+
+	return result;
+}
+
+static bignum_t *bignum_multiply(const bignum_t *left, const bignum_t *right) {
+	bignum_t *result = bignum_alloc(left->size + right->size);
+
+	for(size_t i = 0; i < left->size; ++i) {
+		uint64_t carry = 0;
+
+		for(size_t j = 0; j < right->size; ++j) {
+			uint64_t current = result->limbs[i + j] + (uint64_t) left->limbs[i] * right->limbs[j] + carry;
+
+			result->limbs[i + j] = (uint32_t) (current % BIGNUM_BASE);
+			carry = current / BIGNUM_BASE;
+		}
+
+		for(size_t j = i + right->size; carry > 0; ++j) {
+			uint64_t current = result->limbs[j] + carry;
+
+			result->limbs[j] = (uint32_t) (current % BIGNUM_BASE);
+			carry = current / BIGNUM_BASE;
+		}
+	}
+
+	bignum_trim(result);
+
+	return result;
+}
+
+#ifndef SILNIA_SEQUENTIAL
+static void bignum_print(const bignum_t *number) {
+	printf("%u", number->limbs[number->size - 1]);
+
+	for(size_t i = number->size - 1; i > 0; --i) {
+		printf("%09u", number->limbs[i - 1]);
+	}
+
+	printf("\n");
+}
+#endif
+
+static void send_range(actor_id_t actor, unsigned long long low, unsigned long long high) {
+	range_t *range = malloc(sizeof(range_t));
+
+	if(range == NULL) {
+		perror("Critical: malloc");
+		exit(1);
+	}
+
+	range->low = low;
+	range->high = high;
+
+	send_message(actor, (message_t) { .message_type = MSG_RANGE,
+									  .nbytes = sizeof(range_t),
+									  .data = range });
+}
+
+/* Hands product of actor's range to its parent (or to main) and dies */
+static void deliver_result(node_state_t *my_state) {
+	if(my_state->root) {
+		tree_result = my_state->partial;
+	}
+	else {
+		send_message(my_state->parent, (message_t) { .message_type = MSG_RESULT,
+													 .nbytes = sizeof(bignum_t *),
+													 .data = my_state->partial });
+	}
+
+	my_state->partial = NULL;
+
+	send_message(actor_id_self(), (message_t) { .message_type = MSG_GODIE,
+												.nbytes = 0,
+												.data = NULL});
+}
+
+void hello_root(void **stateptr,
+				__attribute__((unused)) size_t nbytes,
+				__attribute__((unused)) void *data) {
+
+	node_state_t *my_state = (node_state_t *) *stateptr;
+
+	my_state->root = true;
+}
+
+void hello_node(void **stateptr,
+				__attribute__((unused)) size_t nbytes,
+				void *data) {
+
+	node_state_t *my_state = (node_state_t *) *stateptr;
+
+	my_state->root = false;
+	my_state->parent = (actor_id_t) data;
+
+	send_message(my_state->parent, (message_t) { .message_type = MSG_CHILD,
+												 .nbytes = sizeof(actor_id_t),
+												 .data = (void *) actor_id_self() });
+}
+
+void range_handler(void **stateptr,
+				   __attribute__((unused)) size_t nbytes,
+				   void *data) {
+
+	range_t *range = (range_t *) data;
+	node_state_t *my_state = (node_state_t *) *stateptr;
+
+	my_state->low = range->low;
+	my_state->high = range->high;
+
+	free(range);
+
+	if(my_state->high < my_state->low || my_state->high - my_state->low < LEAF_RANGE) {
+		my_state->partial = bignum_range_product(my_state->low, my_state->high);
+		deliver_result(my_state);
+	}
+	else {
+		for(size_t i = 0; i < 2; ++i) {
+			send_message(actor_id_self(), (message_t) { .message_type = MSG_SPAWN,
+														.nbytes = sizeof(role_t *),
+														.data = &roles_node });
+		}
+	}
+}
+
+void child_handler(void **stateptr,
+				   __attribute__((unused)) size_t nbytes,
+				   void *data) {
+
+	node_state_t *my_state = (node_state_t *) *stateptr;
+	unsigned long long middle = my_state->low + (my_state->high - my_state->low) / 2;
+
+	if(my_state->children == 0) {
+		send_range((actor_id_t) data, my_state->low, middle);
+	}
+	else {
+		send_range((actor_id_t) data, middle + 1, my_state->high);
+	}
+
+	my_state->children++;
+}
+
+void result_handler(void **stateptr,
+					__attribute__((unused)) size_t nbytes,
+					void *data) {
+
+	bignum_t *product = (bignum_t *) data;
+	node_state_t *my_state = (node_state_t *) *stateptr;
+
+	if(my_state->partial == NULL) {
+		my_state->partial = product;
+	}
+	else {
+		bignum_t *merged = bignum_multiply(my_state->partial, product);
+
+		free(my_state->partial);
+		free(product);
+
+		my_state->partial = merged;
+	}
+
+	my_state->results++;
+
+	if(my_state->results == 2) {
+		deliver_result(my_state);
+	}
+}
+
 /* Main function */
 
 int main(void) {
 	unsigned long long int n;
-	unsigned long long int res = 1;
 
 	scanf("%llu", &n);
 
 	int err;
 	actor_id_t first;
 
+#ifndef SILNIA_SEQUENTIAL
+	if(n >= BIGNUM_BASE) {
+		fprintf(stderr, "Error: n has to be below %u\n", BIGNUM_BASE);
+		return 1;
+	}
+
+	if((err = actor_system_create(&first, &roles_root)) != 0) {
+		perror("Error in creating actor system...\n");
+		return 1;
+	}
+
+	send_range(first, 1, n);
+
+	actor_system_join(first);
+
+	bignum_print(tree_result);
+	free(tree_result);
+#else
+	unsigned long long int res = 1;
+
 	/* structure passed ONLY to first actor */
 	state_t *initial = malloc(sizeof(state_t));
 
@@ -181,6 +468,7 @@ int main(void) {
 	printf("%llu\n", res);
 
 	free(initial);
+#endif
 
 	return 0;
 }
\ No newline at end of file
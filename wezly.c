@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "cacti.h"
+
+/* Two processes attached to one shared memory segment as nodes 0 and 1;
+ * actor 0 of node 0 sends ROUNDS pings to actor 0 of node 1, which
+ * answers every one of them. Each node reports how many MSG_HELLO its
+ * first actor got, which has to be exactly one. */
+
+#define MSG_PING 1
+#define MSG_PONG 2
+
+#ifndef ROUNDS
+#define ROUNDS 500
+#endif
+
+#define SEGMENT_NAME "/cacti_wezly"
+
+void hello_handler(void **, size_t, void *);
+void ping_handler(void **, size_t, void *);
+void pong_handler(void **, size_t, void *);
+
+/* Struct used as state of first actor of each node */
+typedef struct node {
+	size_t hellos;
+	size_t messages;
+} node_t;
+
+/* Payload of ping, copied into segment on the way to other node */
+typedef struct ping {
+	actor_id_t from;
+	long round;
+} ping_t;
+
+act_t prompts[] = { hello_handler, ping_handler, pong_handler };
+
+role_t role = (role_t) { .nprompts = 3, .prompts = prompts,
+						 .state_size = sizeof(node_t) };
+
+/* Counted outside of state, which is reclaimed once actor dies */
+static size_t hellos;
+
+void hello_handler(void **stateptr,
+				   __attribute__((unused)) size_t nbytes,
+				   __attribute__((unused)) void *data) {
+
+	node_t *my_state = (node_t *) *stateptr;
+
+	my_state->hellos++;
+	hellos = my_state->hellos;
+
+	if(ACTOR_NODE(actor_id_self()) != 0) {
+		return;
+	}
+
+	ping_t ping = { .from = actor_id_self() };
+
+	for(long i = 0; i < ROUNDS; ++i) {
+		ping.round = i;
+
+		while(send_message(ACTOR_ID(1, 0), (message_t) { .message_type = MSG_PING,
+														 .nbytes = sizeof(ping_t),
+														 .data = &ping }) == -3) {
+			usleep(100);
+		}
+	}
+}
+
+void ping_handler(void **stateptr,
+				  size_t nbytes,
+				  void *data) {
+
+	node_t *my_state = (node_t *) *stateptr;
+	ping_t *ping = (ping_t *) data;
+
+	if(nbytes != sizeof(ping_t)) {
+		fprintf(stderr, "Error: malformed ping\n");
+		exit(1);
+	}
+
+	send_message(ping->from, (message_t) { .message_type = MSG_PONG,
+										   .nbytes = 0,
+										   .data = (void *) ping->round });
+
+	if(++my_state->messages == ROUNDS) {
+		send_message(actor_id_self(), (message_t) { .message_type = MSG_GODIE });
+	}
+}
+
+void pong_handler(void **stateptr,
+				  __attribute__((unused)) size_t nbytes,
+				  __attribute__((unused)) void *data) {
+
+	node_t *my_state = (node_t *) *stateptr;
+
+	if(++my_state->messages == ROUNDS) {
+		send_message(actor_id_self(), (message_t) { .message_type = MSG_GODIE });
+	}
+}
+
+static int run_node(size_t node) {
+	actor_id_t first;
+
+	if(actor_system_attach(SEGMENT_NAME, node, 2) != 0) {
+		fprintf(stderr, "Error: node %zu can't attach\n", node);
+		return 1;
+	}
+
+	if(actor_system_create(&first, &role) != 0) {
+		perror("Error in creating actor system...\n");
+		return 1;
+	}
+
+	actor_system_join(first);
+	actor_system_detach();
+
+	printf("node %zu: %zu hello\n", node, hellos);
+
+	return hellos == 1 ? 0 : 1;
+}
+
+int main(void) {
+	int status;
+	pid_t child = fork();
+
+	if(child < 0) {
+		perror("Critical: fork");
+		return 1;
+	}
+
+	if(child == 0) {
+		return run_node(1);
+	}
+
+	int err = run_node(0);
+
+	if(waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		err = 1;
+	}
+
+	return err;
+}